@@ -0,0 +1,248 @@
+/*
+ *  Native benchmark of the memfootprint_mt per-thread address table
+ *  (addr_table.H) against the std::map it replaced.  Both run the
+ *  CountBytes update over the same synthetic access streams; the output
+ *  gives accesses per second and memory per tracked address.
+ *
+ *      addr_table_bench [-n accesses] [-f footprint]
+ *
+ *  Memory for the map is measured with a counting allocator and includes
+ *  an estimated MALLOC_OVERHEAD bytes per allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <memory>
+#include "addr_table.H"
+
+#define MALLOC_OVERHEAD 16
+
+// The record memfootprint_mt used to keep per address
+struct OLD_ADDRSTAT {
+    uint32_t accesses;
+    uint32_t all_bytes_read;
+    uint32_t smallest_byte_read;
+    uint32_t largest_byte_read;
+    bool is_read;
+    bool is_write;
+};
+
+static uint64_t allocatedBytes = 0;
+
+// Keeps the compiler from dropping the byte counts
+static volatile uint64_t sink;
+
+template <class T>
+class COUNTING_ALLOCATOR : public std::allocator<T>
+{
+  public:
+    typedef size_t size_type;
+    typedef T * pointer;
+    template <class U> struct rebind { typedef COUNTING_ALLOCATOR<U> other; };
+
+    COUNTING_ALLOCATOR() {}
+    COUNTING_ALLOCATOR(const COUNTING_ALLOCATOR & a) : std::allocator<T>(a) {}
+    template <class U> COUNTING_ALLOCATOR(const COUNTING_ALLOCATOR<U> & a) : std::allocator<T>(a) {}
+
+    pointer allocate(size_type n, const void * = 0)
+    {
+        allocatedBytes += n * sizeof(T) + MALLOC_OVERHEAD;
+        return std::allocator<T>::allocate(n);
+    }
+    void deallocate(pointer p, size_type n)
+    {
+        allocatedBytes -= n * sizeof(T) + MALLOC_OVERHEAD;
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+typedef std::map<uint64_t, OLD_ADDRSTAT, std::less<uint64_t>,
+                 COUNTING_ALLOCATOR<std::pair<const uint64_t, OLD_ADDRSTAT> > > ADDR_MAP;
+
+struct ACCESS
+{
+    uint64_t addr;
+    uint32_t size;
+    uint32_t is_read;
+};
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t Rand(uint64_t * state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Fills accesses with one of the synthetic patterns over footprint distinct addresses
+static void Generate(const char * pattern, uint64_t footprint, std::vector<ACCESS> & accesses)
+{
+    static const uint32_t sizes[] = { 8, 8, 8, 4, 4, 2, 1, 16 };
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    const uint64_t base = 0x7f0000000000ULL;
+
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        uint64_t r = Rand(&state);
+        uint64_t slot;
+        if (strcmp(pattern, "stream") == 0)
+            slot = i % footprint;
+        else if (strcmp(pattern, "hot") == 0)
+        {
+            // 90% of the accesses go to 10% of the addresses
+            uint64_t hot = footprint / 10 + 1;
+            slot = (r % 10) ? (r >> 8) % hot : (r >> 8) % footprint;
+        }
+        else
+            slot = (r >> 8) % footprint;
+
+        accesses[i].addr = base + slot * 8;
+        accesses[i].size = sizes[r & 7];
+        accesses[i].is_read = (r >> 3) % 3 != 0;
+    }
+}
+
+static void RunMap(const std::vector<ACCESS> & accesses, double * seconds, uint64_t * size,
+                   uint64_t * bytes)
+{
+    allocatedBytes = 0;
+    ADDR_MAP * addrs = new ADDR_MAP;
+    uint64_t all_bytes_read = 0;
+
+    double start = Now();
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        uint64_t addr = accesses[i].addr;
+        uint32_t size = accesses[i].size;
+        bool l = accesses[i].is_read;
+        bool s = !l;
+
+        all_bytes_read += size;
+        ADDR_MAP::iterator itr = addrs->find(addr);
+        if (itr == addrs->end()) {
+            OLD_ADDRSTAT new_stat = {1, size, size, size, l, s};
+            (*addrs)[addr] = new_stat;
+        }
+        else {
+            (itr->second).accesses++;
+            (itr->second).all_bytes_read += size;
+            if (!(itr->second).is_read)
+                (itr->second).is_read = l;
+            if (!(itr->second).is_write)
+                (itr->second).is_write = s;
+            if ((itr->second).smallest_byte_read > size)
+                (itr->second).smallest_byte_read = size;
+            if ((itr->second).largest_byte_read < size)
+                (itr->second).largest_byte_read = size;
+        }
+    }
+    *seconds = Now() - start;
+    *size = addrs->size();
+    *bytes = allocatedBytes;
+
+    sink = all_bytes_read;
+    delete addrs;
+}
+
+static void RunTable(const std::vector<ACCESS> & accesses, double * seconds, uint64_t * size,
+                     uint64_t * bytes)
+{
+    ADDR_TABLE * addrs = new ADDR_TABLE;
+    uint64_t all_bytes_read = 0;
+
+    double start = Now();
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        uint32_t size = accesses[i].size;
+        bool l = accesses[i].is_read;
+        bool s = !l;
+
+        all_bytes_read += size;
+        bool created;
+        ADDRSTAT * stat = addrs->Lookup(accesses[i].addr, &created);
+        if (created) {
+            stat->accesses = 1;
+            stat->all_bytes_read = size;
+            stat->smallest_byte_read = size;
+            stat->largest_byte_read = size;
+            stat->is_read = l;
+            stat->is_write = s;
+        }
+        else {
+            stat->accesses++;
+            stat->all_bytes_read += size;
+            if (!stat->is_read)
+                stat->is_read = l;
+            if (!stat->is_write)
+                stat->is_write = s;
+            if (stat->smallest_byte_read > size)
+                stat->smallest_byte_read = size;
+            if (stat->largest_byte_read < size)
+                stat->largest_byte_read = size;
+        }
+    }
+    *seconds = Now() - start;
+    *size = addrs->Size();
+    *bytes = addrs->MemoryUsage();
+
+    sink = all_bytes_read;
+    delete addrs;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t numAccesses = 8000000;
+    uint64_t footprint = 1000000;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            numAccesses = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            footprint = strtoull(argv[++i], NULL, 0);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n accesses] [-f footprint]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (footprint == 0)
+        footprint = 1;
+
+    static const char * patterns[] = { "stream", "random", "hot" };
+    std::vector<ACCESS> accesses(numAccesses);
+
+    printf("# %llu accesses over %llu addresses\n",
+           (unsigned long long)numAccesses, (unsigned long long)footprint);
+    printf("%-8s %-10s %12s %14s %16s\n",
+           "pattern", "table", "addrs", "Maccesses/s", "bytes/addr");
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        Generate(patterns[p], footprint, accesses);
+
+        double seconds;
+        uint64_t size, bytes;
+
+        RunMap(accesses, &seconds, &size, &bytes);
+        printf("%-8s %-10s %12llu %14.1f %16.1f\n", patterns[p], "std::map",
+               (unsigned long long)size, numAccesses / seconds / 1e6, (double)bytes / size);
+
+        RunTable(accesses, &seconds, &size, &bytes);
+        printf("%-8s %-10s %12llu %14.1f %16.1f\n", patterns[p], "ADDR_TABLE",
+               (unsigned long long)size, numAccesses / seconds / 1e6, (double)bytes / size);
+    }
+    return 0;
+}
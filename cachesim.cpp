@@ -0,0 +1,453 @@
+/*
+ *  Cache and coherence simulator.  See cachesim.H.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <algorithm>
+#include "cachesim.H"
+
+#define NO_OWNER 0xff
+
+void CACHESIM_STATS::Add(const CACHESIM_STATS & s)
+{
+    accesses += s.accesses;
+    l1Hits += s.l1Hits;
+    l2Hits += s.l2Hits;
+    llcHits += s.llcHits;
+    misses += s.misses;
+    invalidations += s.invalidations;
+    transfers += s.transfers;
+}
+
+static bool IsPowerOfTwo(uint64_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+static uint32_t Log2(uint64_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+
+// The part of one set-associative LRU cache that belongs to a shard.
+// Entries are found by index, set * assoc + way.
+class CACHESIM_LEVEL
+{
+  public:
+    CACHESIM_LEVEL() : _sets(0), _assoc(0), _shardBits(0), _clock(0) {}
+
+    void Init(uint64_t sets, uint32_t assoc, uint32_t shardBits)
+    {
+        _sets = sets;
+        _assoc = assoc;
+        _shardBits = shardBits;
+        _tags.assign(sets * assoc, 0);
+        _stamps.assign(sets * assoc, 0);
+        _modified.assign(sets * assoc, 0);
+    }
+
+    // Index of the entry holding line, or -1
+    int64_t Find(uint64_t line) const
+    {
+        uint64_t base = Set(line) * _assoc;
+        for (uint32_t w = 0; w < _assoc; w++)
+        {
+            if (_tags[base + w] == line + 1)
+                return base + w;
+        }
+        return -1;
+    }
+
+    void Touch(uint64_t i)
+    {
+        _stamps[i] = ++_clock;
+    }
+
+    // Puts line, which must not be present, in the least recently used
+    // way of its set.  Sets victim to the line evicted plus one, or 0.
+    uint64_t Insert(uint64_t line, uint64_t * victim)
+    {
+        uint64_t base = Set(line) * _assoc;
+        uint64_t i = base;
+        for (uint32_t w = 0; w < _assoc; w++)
+        {
+            if (_tags[base + w] == 0)
+            {
+                i = base + w;
+                break;
+            }
+            if (_stamps[base + w] < _stamps[i])
+                i = base + w;
+        }
+        *victim = _tags[i];
+        _tags[i] = line + 1;
+        _modified[i] = 0;
+        Touch(i);
+        return i;
+    }
+
+    void Remove(uint64_t line)
+    {
+        int64_t i = Find(line);
+        if (i >= 0)
+            _tags[i] = 0;
+    }
+
+    // Whether the core is known to hold the entry modified, so that a
+    // write hit needs no directory lookup.  Clear is always safe.
+    bool Modified(uint64_t i) const { return _modified[i] != 0; }
+    void SetModified(uint64_t i, bool m) { _modified[i] = m; }
+
+  private:
+    uint64_t Set(uint64_t line) const
+    {
+        return (line >> _shardBits) & (_sets - 1);
+    }
+
+    uint64_t _sets;
+    uint32_t _assoc;
+    uint32_t _shardBits;
+    uint64_t _clock;
+    std::vector<uint64_t> _tags;        // line + 1, 0 for an empty way
+    std::vector<uint64_t> _stamps;      // of the last use
+    std::vector<uint8_t> _modified;
+};
+
+// Open addressing table of the misses of each instruction
+class CACHESIM_IP_TABLE
+{
+  public:
+    CACHESIM_IP_TABLE() : _count(0)
+    {
+        _slots.resize(1024);
+    }
+
+    void Count(uint64_t ip, bool llcMiss)
+    {
+        if ((_count + 1) * 4 > _slots.size() * 3)
+            Grow();
+        SLOT * s = Slot(ip);
+        if (s->ip == 0)
+        {
+            s->ip = ip + 1;
+            _count++;
+        }
+        s->l1Misses++;
+        s->llcMisses += llcMiss;
+    }
+
+    void Collect(std::map<uint64_t, CACHESIM_IP_STATS> & all) const
+    {
+        for (size_t i = 0; i < _slots.size(); i++)
+        {
+            if (_slots[i].ip == 0)
+                continue;
+            CACHESIM_IP_STATS & s = all[_slots[i].ip - 1];
+            s.ip = _slots[i].ip - 1;
+            s.l1Misses += _slots[i].l1Misses;
+            s.llcMisses += _slots[i].llcMisses;
+        }
+    }
+
+  private:
+    struct SLOT
+    {
+        uint64_t ip;            // ip + 1, 0 for an empty slot
+        uint64_t l1Misses;
+        uint64_t llcMisses;
+
+        SLOT() : ip(0), l1Misses(0), llcMisses(0) {}
+    };
+
+    SLOT * Slot(uint64_t ip)
+    {
+        size_t mask = _slots.size() - 1;
+        size_t i = (ip * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+        while (_slots[i].ip != 0 && _slots[i].ip != ip + 1)
+            i = (i + 1) & mask;
+        return &_slots[i];
+    }
+
+    void Grow()
+    {
+        std::vector<SLOT> old;
+        old.swap(_slots);
+        _slots.resize(old.size() * 2);
+        for (size_t i = 0; i < old.size(); i++)
+        {
+            if (old[i].ip != 0)
+                *Slot(old[i].ip - 1) = old[i];
+        }
+    }
+
+    size_t _count;
+    std::vector<SLOT> _slots;
+};
+
+// The caches of every core and the LLC for the lines of one shard, and
+// the statistics of the accesses simulated in it
+class CACHESIM_SHARD
+{
+  public:
+    CACHESIM_SHARD(const CACHESIM_CONFIG & c, uint32_t shardBits)
+      : _l1(c.cores), _l2(c.cores)
+    {
+        uint32_t shards = 1 << shardBits;
+        for (uint32_t i = 0; i < c.cores; i++)
+        {
+            _l1[i].Init(c.l1Size / c.lineSize / c.l1Assoc / shards, c.l1Assoc, shardBits);
+            _l2[i].Init(c.l2Size / c.lineSize / c.l2Assoc / shards, c.l2Assoc, shardBits);
+        }
+        _llc.Init(c.llcSize / c.lineSize / c.llcAssoc / shards, c.llcAssoc, shardBits);
+        _sharers.assign(c.llcSize / c.lineSize / shards, 0);
+        _owner.assign(c.llcSize / c.lineSize / shards, NO_OWNER);
+    }
+
+    void Access(uint32_t thread, uint32_t core, uint64_t line, bool write, uint64_t ip)
+    {
+        if (thread >= _stats.size())
+            _stats.resize(thread + 1);
+        CACHESIM_STATS & st = _stats[thread];
+        CACHESIM_LEVEL & l1 = _l1[core];
+        CACHESIM_LEVEL & l2 = _l2[core];
+        st.accesses++;
+
+        int64_t i = l1.Find(line);
+        if (i >= 0)
+        {
+            l1.Touch(i);
+            st.l1Hits++;
+            if (write && !l1.Modified(i))
+            {
+                Exclusive(_llc.Find(line), line, core, st);
+                l1.SetModified(i, true);
+            }
+            return;
+        }
+
+        int64_t j = l2.Find(line);
+        if (j >= 0)
+        {
+            l2.Touch(j);
+            st.l2Hits++;
+            _ips.Count(ip, false);
+            i = FillL1(core, line);
+            if (write)
+            {
+                Exclusive(_llc.Find(line), line, core, st);
+                l1.SetModified(i, true);
+            }
+            return;
+        }
+
+        int64_t k = _llc.Find(line);
+        if (k >= 0)
+        {
+            _llc.Touch(k);
+            st.llcHits++;
+            _ips.Count(ip, false);
+
+            // A line modified in another core is written back; on a read
+            // both keep it shared
+            if (_owner[k] != NO_OWNER && _owner[k] != core)
+            {
+                st.transfers++;
+                if (!write)
+                {
+                    int64_t m = _l1[_owner[k]].Find(line);
+                    if (m >= 0)
+                        _l1[_owner[k]].SetModified(m, false);
+                    _owner[k] = NO_OWNER;
+                }
+            }
+        }
+        else
+        {
+            uint64_t victim;
+            k = _llc.Insert(line, &victim);
+            if (victim)
+                BackInvalidate(victim - 1, _sharers[k]);
+            _sharers[k] = 0;
+            _owner[k] = NO_OWNER;
+            st.misses++;
+            _ips.Count(ip, true);
+        }
+
+        FillL2(core, line);
+        i = FillL1(core, line);
+        _sharers[k] |= 1ULL << core;
+        if (write)
+        {
+            Exclusive(k, line, core, st);
+            l1.SetModified(i, true);
+        }
+    }
+
+    const std::vector<CACHESIM_STATS> & Stats() const { return _stats; }
+    const CACHESIM_IP_TABLE & Ips() const { return _ips; }
+
+  private:
+    // Makes the core the only holder and owner of LLC entry k
+    void Exclusive(int64_t k, uint64_t line, uint32_t core, CACHESIM_STATS & st)
+    {
+        for (uint64_t m = _sharers[k] & ~(1ULL << core); m; m &= m - 1)
+        {
+            uint32_t c = __builtin_ctzll(m);
+            _l1[c].Remove(line);
+            _l2[c].Remove(line);
+            st.invalidations++;
+        }
+        _sharers[k] = 1ULL << core;
+        _owner[k] = core;
+    }
+
+    // The line is no longer in the LLC, so it may not stay in the cores
+    void BackInvalidate(uint64_t line, uint64_t sharers)
+    {
+        for (uint64_t m = sharers; m; m &= m - 1)
+        {
+            uint32_t c = __builtin_ctzll(m);
+            _l1[c].Remove(line);
+            _l2[c].Remove(line);
+        }
+    }
+
+    int64_t FillL1(uint32_t core, uint64_t line)
+    {
+        uint64_t victim;
+        return _l1[core].Insert(line, &victim);
+    }
+
+    // The L2 includes the L1, and a line that leaves the core takes the
+    // core out of the directory, written back if it was modified
+    void FillL2(uint32_t core, uint64_t line)
+    {
+        uint64_t victim;
+        _l2[core].Insert(line, &victim);
+        if (!victim)
+            return;
+        _l1[core].Remove(victim - 1);
+        int64_t k = _llc.Find(victim - 1);
+        if (k >= 0)
+        {
+            _sharers[k] &= ~(1ULL << core);
+            if (_owner[k] == core)
+                _owner[k] = NO_OWNER;
+        }
+    }
+
+    std::vector<CACHESIM_LEVEL> _l1;
+    std::vector<CACHESIM_LEVEL> _l2;
+    CACHESIM_LEVEL _llc;
+    std::vector<uint64_t> _sharers;     // directory, per LLC entry
+    std::vector<uint8_t> _owner;        // core holding the line modified, or NO_OWNER
+
+    std::vector<CACHESIM_STATS> _stats; // per thread
+    CACHESIM_IP_TABLE _ips;
+};
+
+CACHE_SIM::CACHE_SIM() : _lineShift(0)
+{
+}
+
+CACHE_SIM::~CACHE_SIM()
+{
+    for (size_t i = 0; i < _shards.size(); i++)
+        delete _shards[i];
+}
+
+bool CACHE_SIM::Init(const CACHESIM_CONFIG & c, const char ** error)
+{
+    if (!IsPowerOfTwo(c.lineSize))
+    {
+        *error = "the line size must be a power of two";
+        return false;
+    }
+    if (c.cores == 0 || c.cores > CACHESIM_MAX_CORES)
+    {
+        *error = "the number of cores must be between 1 and 64";
+        return false;
+    }
+    if (!IsPowerOfTwo(c.shards))
+    {
+        *error = "the number of shards must be a power of two";
+        return false;
+    }
+
+    uint64_t sizes[3] = { c.l1Size, c.l2Size, c.llcSize };
+    uint32_t assocs[3] = { c.l1Assoc, c.l2Assoc, c.llcAssoc };
+    for (int i = 0; i < 3; i++)
+    {
+        if (assocs[i] == 0 || sizes[i] % ((uint64_t)c.lineSize * assocs[i]) != 0
+            || !IsPowerOfTwo(sizes[i] / c.lineSize / assocs[i]))
+        {
+            *error = "every cache must have a power of two number of sets";
+            return false;
+        }
+        if (sizes[i] / c.lineSize / assocs[i] < c.shards)
+        {
+            *error = "a cache has fewer sets than there are shards";
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < _shards.size(); i++)
+        delete _shards[i];
+    _shards.clear();
+
+    _config = c;
+    _lineShift = Log2(c.lineSize);
+    for (uint32_t i = 0; i < c.shards; i++)
+        _shards.push_back(new CACHESIM_SHARD(c, Log2(c.shards)));
+    return true;
+}
+
+void CACHE_SIM::Simulate(uint32_t shard, uint32_t thread, uint32_t core,
+                         const CACHESIM_ACCESS * accesses, size_t n)
+{
+    CACHESIM_SHARD * s = _shards[shard];
+    for (size_t i = 0; i < n; i++)
+        s->Access(thread, core, Line(accesses[i].addr), accesses[i].write != 0, accesses[i].ip);
+}
+
+uint32_t CACHE_SIM::NumThreads() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i < _shards.size(); i++)
+        n = std::max(n, _shards[i]->Stats().size());
+    return n;
+}
+
+CACHESIM_STATS CACHE_SIM::ThreadStats(uint32_t thread) const
+{
+    CACHESIM_STATS total;
+    for (size_t i = 0; i < _shards.size(); i++)
+    {
+        if (thread < _shards[i]->Stats().size())
+            total.Add(_shards[i]->Stats()[thread]);
+    }
+    return total;
+}
+
+static bool MoreMisses(const CACHESIM_IP_STATS & a, const CACHESIM_IP_STATS & b)
+{
+    if (a.l1Misses != b.l1Misses)
+        return a.l1Misses > b.l1Misses;
+    return a.ip < b.ip;
+}
+
+void CACHE_SIM::TopMisses(size_t n, std::vector<CACHESIM_IP_STATS> & top) const
+{
+    std::map<uint64_t, CACHESIM_IP_STATS> all;
+    for (size_t i = 0; i < _shards.size(); i++)
+        _shards[i]->Ips().Collect(all);
+
+    top.clear();
+    for (std::map<uint64_t, CACHESIM_IP_STATS>::const_iterator it = all.begin(); it != all.end(); it++)
+        top.push_back(it->second);
+    n = std::min(n, top.size());
+    std::partial_sort(top.begin(), top.begin() + n, top.end(), MoreMisses);
+    top.resize(n);
+}
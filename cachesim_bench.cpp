@@ -0,0 +1,203 @@
+/*
+ *  Native throughput benchmark of the cache simulator (cachesim.H).  The
+ *  synthetic accesses of eight threads are split by shard up front, as
+ *  pinatrace_mt -cachesim does, and the shards are simulated by 1, 2, 4
+ *  ... up to -j worker threads, each owning every j-th shard.  The output
+ *  gives simulated accesses per second and the L1 hit ratio.
+ *
+ *      cachesim_bench [-n accesses] [-f footprint_lines] [-j workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include "cachesim.H"
+
+#define BENCH_THREADS 8
+#define BENCH_BATCH 4096
+
+struct SHARD_STREAM
+{
+    std::vector<CACHESIM_ACCESS> accesses;
+    std::vector<uint32_t> threads;      // of each batch
+    std::vector<size_t> starts;         // of each batch, and the end
+};
+
+struct WORKER
+{
+    CACHE_SIM * sim;
+    std::vector<SHARD_STREAM> * shards;
+    uint32_t first;
+    uint32_t step;
+    pthread_t thread;
+};
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t Rand(uint64_t * state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Fills the per-shard streams with batches of accesses of the threads in
+// turn, each thread following the pattern over footprint lines, a quarter
+// of them shared by all threads
+static void Generate(const char * pattern, uint64_t numAccesses, uint64_t footprint,
+                     const CACHE_SIM & sim, std::vector<SHARD_STREAM> & shards)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    const uint64_t base = 0x7f0000000000ULL;
+    uint64_t position[BENCH_THREADS] = { 0 };
+
+    for (size_t s = 0; s < shards.size(); s++)
+    {
+        shards[s].accesses.clear();
+        shards[s].threads.clear();
+        shards[s].starts.clear();
+    }
+
+    for (uint64_t i = 0; i < numAccesses; i += BENCH_BATCH)
+    {
+        uint32_t t = (i / BENCH_BATCH) % BENCH_THREADS;
+        std::vector<std::vector<CACHESIM_ACCESS> > batch(shards.size());
+        for (uint64_t j = i; j < i + BENCH_BATCH && j < numAccesses; j++)
+        {
+            uint64_t r = Rand(&state);
+            uint64_t line;
+            if (strcmp(pattern, "stream") == 0)
+                line = position[t]++ % footprint;
+            else if (strcmp(pattern, "hot") == 0)
+            {
+                // 90% of the accesses go to 10% of the lines
+                uint64_t hot = footprint / 10 + 1;
+                line = (r % 10) ? (r >> 8) % hot : (r >> 8) % footprint;
+            }
+            else
+                line = (r >> 8) % footprint;
+            bool shared = (r >> 4) % 4 == 0;
+
+            CACHESIM_ACCESS a;
+            a.ip = 0x400000 + (r >> 40) % 256 * 4;
+            a.addr = base + (shared ? 0 : (uint64_t)(t + 1) << 32) + line * 64;
+            a.size = 8;
+            a.write = (r >> 3) % 3 == 0;
+            batch[sim.ShardOf(a.addr)].push_back(a);
+        }
+        for (size_t s = 0; s < shards.size(); s++)
+        {
+            if (batch[s].empty())
+                continue;
+            shards[s].threads.push_back(t);
+            shards[s].starts.push_back(shards[s].accesses.size());
+            shards[s].accesses.insert(shards[s].accesses.end(), batch[s].begin(), batch[s].end());
+        }
+    }
+    for (size_t s = 0; s < shards.size(); s++)
+        shards[s].starts.push_back(shards[s].accesses.size());
+}
+
+static void * Work(void * arg)
+{
+    WORKER * w = static_cast<WORKER *>(arg);
+    for (uint32_t s = w->first; s < w->shards->size(); s += w->step)
+    {
+        SHARD_STREAM & stream = (*w->shards)[s];
+        for (size_t b = 0; b < stream.threads.size(); b++)
+        {
+            uint32_t t = stream.threads[b];
+            w->sim->Simulate(s, t, t, &stream.accesses[stream.starts[b]],
+                             stream.starts[b + 1] - stream.starts[b]);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t numAccesses = 16000000;
+    uint64_t footprint = 1 << 14;
+    uint32_t maxWorkers = 8;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            numAccesses = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            footprint = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            maxWorkers = strtoul(argv[++i], NULL, 0);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n accesses] [-f footprint_lines] [-j workers]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (footprint == 0)
+        footprint = 1;
+    if (maxWorkers == 0)
+        maxWorkers = 1;
+
+    static const char * patterns[] = { "stream", "random", "hot" };
+
+    printf("# %llu accesses of %d threads over %llu lines each\n",
+           (unsigned long long)numAccesses, BENCH_THREADS, (unsigned long long)footprint);
+    printf("%-8s %8s %8s %14s %10s\n", "pattern", "workers", "shards", "Maccesses/s", "l1_hits");
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        for (uint32_t workers = 1; workers <= maxWorkers; workers *= 2)
+        {
+            CACHESIM_CONFIG config;
+            config.cores = BENCH_THREADS;
+            config.shards = workers;
+            CACHE_SIM sim;
+            const char * error;
+            if (!sim.Init(config, &error))
+            {
+                fprintf(stderr, "Error: %s\n", error);
+                return 1;
+            }
+
+            std::vector<SHARD_STREAM> shards(config.shards);
+            Generate(patterns[p], numAccesses, footprint, sim, shards);
+            uint64_t simulated = 0;
+            for (size_t s = 0; s < shards.size(); s++)
+                simulated += shards[s].accesses.size();
+
+            std::vector<WORKER> w(workers);
+            double start = Now();
+            for (uint32_t i = 0; i < workers; i++)
+            {
+                w[i].sim = &sim;
+                w[i].shards = &shards;
+                w[i].first = i;
+                w[i].step = workers;
+                if (i > 0)
+                    pthread_create(&w[i].thread, NULL, Work, &w[i]);
+            }
+            Work(&w[0]);
+            for (uint32_t i = 1; i < workers; i++)
+                pthread_join(w[i].thread, NULL);
+            double seconds = Now() - start;
+
+            CACHESIM_STATS total;
+            for (uint32_t t = 0; t < sim.NumThreads(); t++)
+                total.Add(sim.ThreadStats(t));
+            printf("%-8s %8u %8u %14.1f %9.1f%%\n", patterns[p], workers, config.shards,
+                   simulated / seconds / 1e6, 100.0 * total.l1Hits / total.accesses);
+        }
+    }
+    return 0;
+}
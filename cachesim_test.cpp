@@ -0,0 +1,250 @@
+/*
+ *  Unit tests of the cache simulator.  Prints the failed checks and exits
+ *  with 1 if there are any.
+ *
+ *  Usage: cachesim_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "cachesim.H"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { unsigned long long _a = (a), _b = (b); if (_a != _b) { \
+        fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #a, _a, _b); \
+        failures++; } } while (0)
+
+// 64 B lines, L1 2 sets x 2 ways, L2 4 sets x 2 ways, LLC 8 sets x 4 ways
+static CACHESIM_CONFIG SmallConfig(uint32_t cores, uint32_t shards)
+{
+    CACHESIM_CONFIG c;
+    c.lineSize = 64;
+    c.l1Size = 2 * 2 * 64;
+    c.l1Assoc = 2;
+    c.l2Size = 4 * 2 * 64;
+    c.l2Assoc = 2;
+    c.llcSize = 8 * 4 * 64;
+    c.llcAssoc = 4;
+    c.cores = cores;
+    c.shards = shards;
+    return c;
+}
+
+static void Access(CACHE_SIM & sim, uint32_t thread, uint32_t core, uint64_t line, bool write,
+                   uint64_t ip = 0x1000)
+{
+    CACHESIM_ACCESS a;
+    a.ip = ip;
+    a.addr = line * 64 + 8;
+    a.size = 8;
+    a.write = write;
+    sim.Simulate(sim.ShardOf(a.addr), thread, core, &a, 1);
+}
+
+static void TestHits()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CHECK(sim.Init(SmallConfig(1, 1), &error));
+
+    Access(sim, 0, 0, 5, false);
+    Access(sim, 0, 0, 5, false);
+    Access(sim, 0, 0, 5, true);
+    CACHESIM_STATS s = sim.ThreadStats(0);
+    CHECK_EQ(s.accesses, 3);
+    CHECK_EQ(s.misses, 1);
+    CHECK_EQ(s.l1Hits, 2);
+    CHECK_EQ(s.invalidations, 0);
+}
+
+// Lines 0, 2 and 4 share an L1 set but only 0 and 4 share an L2 set
+static void TestLru()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CHECK(sim.Init(SmallConfig(1, 1), &error));
+
+    Access(sim, 0, 0, 0, false);
+    Access(sim, 0, 0, 2, false);
+    Access(sim, 0, 0, 0, false);        // 2 becomes least recently used
+    Access(sim, 0, 0, 4, false);        // evicts 2 from the L1
+    Access(sim, 0, 0, 0, false);
+    CACHESIM_STATS s = sim.ThreadStats(0);
+    CHECK_EQ(s.misses, 3);
+    CHECK_EQ(s.l1Hits, 2);
+
+    Access(sim, 0, 0, 2, false);        // still in the L2
+    s = sim.ThreadStats(0);
+    CHECK_EQ(s.l2Hits, 1);
+
+    // The L2 set of 0 and 4 overflows: 8 evicts 0 and takes it out of the L1
+    Access(sim, 0, 0, 4, false);
+    Access(sim, 0, 0, 8, false);
+    Access(sim, 0, 0, 0, false);
+    s = sim.ThreadStats(0);
+    CHECK_EQ(s.llcHits, 1);
+}
+
+static void TestInvalidation()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CHECK(sim.Init(SmallConfig(3, 1), &error));
+
+    Access(sim, 0, 0, 1, false);
+    Access(sim, 1, 1, 1, false);
+    Access(sim, 2, 2, 1, false);
+    Access(sim, 0, 0, 1, true);         // removes the copies of cores 1 and 2
+    CHECK_EQ(sim.ThreadStats(0).invalidations, 2);
+    CHECK_EQ(sim.ThreadStats(0).l1Hits, 1);
+
+    Access(sim, 1, 1, 1, false);        // fetched from core 0, which keeps it shared
+    CACHESIM_STATS s = sim.ThreadStats(1);
+    CHECK_EQ(s.l1Hits, 0);
+    CHECK_EQ(s.llcHits, 2);         // its first read was an LLC hit too
+    CHECK_EQ(s.transfers, 1);
+
+    Access(sim, 0, 0, 1, true);         // core 0 has to upgrade again
+    CHECK_EQ(sim.ThreadStats(0).invalidations, 3);
+
+    // Writes of the owner need no more invalidations
+    Access(sim, 0, 0, 1, true);
+    CHECK_EQ(sim.ThreadStats(0).invalidations, 3);
+
+    // Threads on one core share its caches
+    Access(sim, 2, 0, 1, true);
+    CHECK_EQ(sim.ThreadStats(2).l1Hits, 1);
+    CHECK_EQ(sim.ThreadStats(2).invalidations, 0);
+}
+
+// The LLC includes the private caches
+static void TestBackInvalidation()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CHECK(sim.Init(SmallConfig(2, 1), &error));
+
+    Access(sim, 0, 0, 0, false);
+    for (uint64_t line = 8; line <= 32; line += 8)
+        Access(sim, 1, 1, line, false); // the LLC set of line 0 overflows
+    Access(sim, 0, 0, 0, false);
+    CACHESIM_STATS s = sim.ThreadStats(0);
+    CHECK_EQ(s.misses, 2);
+    CHECK_EQ(s.l1Hits, 0);
+}
+
+static void TestIps()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CHECK(sim.Init(SmallConfig(1, 1), &error));
+
+    for (uint64_t line = 0; line < 100; line++)
+        Access(sim, 0, 0, line, false, 0x10);
+    for (uint64_t line = 0; line < 10; line++)
+        Access(sim, 0, 0, line * 1000, false, 0x20);
+    Access(sim, 0, 0, 99, false, 0x30);
+
+    std::vector<CACHESIM_IP_STATS> top;
+    sim.TopMisses(2, top);
+    CHECK_EQ(top.size(), 2);
+    if (top.size() == 2)
+    {
+        CHECK_EQ(top[0].ip, 0x10);
+        CHECK_EQ(top[0].l1Misses, 100);
+        CHECK_EQ(top[0].llcMisses, 100);
+        CHECK_EQ(top[1].ip, 0x20);
+    }
+}
+
+// Splitting the lines over shards must not change anything
+static void TestShards()
+{
+    std::vector<CACHESIM_ACCESS> accesses(200000);
+    std::vector<uint32_t> threads(accesses.size());
+    srand(1);
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        threads[i] = rand() % 6;
+        accesses[i].ip = rand() % 50;
+        accesses[i].addr = (uint64_t)(rand() % 4096) * 64 + (threads[i] % 2) * (1 << 20);
+        accesses[i].size = 4;
+        accesses[i].write = rand() % 4 == 0;
+    }
+
+    CACHESIM_CONFIG c = SmallConfig(4, 1);
+    c.l1Size *= 4;
+    c.l2Size *= 4;
+    c.llcSize *= 4;
+
+    CACHE_SIM one;
+    CACHE_SIM four;
+    const char * error;
+    CHECK(one.Init(c, &error));
+    c.shards = 4;
+    CHECK(four.Init(c, &error));
+
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        uint32_t core = threads[i] % 4;
+        one.Simulate(0, threads[i], core, &accesses[i], 1);
+        four.Simulate(four.ShardOf(accesses[i].addr), threads[i], core, &accesses[i], 1);
+    }
+
+    CHECK_EQ(one.NumThreads(), four.NumThreads());
+    for (uint32_t t = 0; t < one.NumThreads(); t++)
+    {
+        CACHESIM_STATS a = one.ThreadStats(t);
+        CACHESIM_STATS b = four.ThreadStats(t);
+        CHECK_EQ(a.accesses, b.accesses);
+        CHECK_EQ(a.l1Hits, b.l1Hits);
+        CHECK_EQ(a.l2Hits, b.l2Hits);
+        CHECK_EQ(a.llcHits, b.llcHits);
+        CHECK_EQ(a.misses, b.misses);
+        CHECK_EQ(a.invalidations, b.invalidations);
+        CHECK_EQ(a.transfers, b.transfers);
+        CHECK(a.invalidations > 0);
+    }
+}
+
+static void TestConfig()
+{
+    CACHE_SIM sim;
+    const char * error;
+    CACHESIM_CONFIG c = SmallConfig(1, 1);
+    c.lineSize = 48;
+    CHECK(!sim.Init(c, &error));
+    c = SmallConfig(65, 1);
+    CHECK(!sim.Init(c, &error));
+    c = SmallConfig(1, 4);              // the L1 has 2 sets
+    CHECK(!sim.Init(c, &error));
+    c = SmallConfig(1, 2);
+    c.l2Size = 3 * 2 * 64;
+    CHECK(!sim.Init(c, &error));
+    CHECK(sim.Init(SmallConfig(1, 2), &error));
+}
+
+int main()
+{
+    TestHits();
+    TestLru();
+    TestInvalidation();
+    TestBackInvalidation();
+    TestIps();
+    TestShards();
+    TestConfig();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -32,137 +32,668 @@ END_LEGAL */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <new>
 #include "pin.H"
 #include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "dirty_set.H"
+#include "dirty_epochs.H"
+#include "sampling.H"
+#include "roi.H"
+#include "async_writer.H"
+#include "selfprof.H"
+#include "statseg.H"
+#include "coalesce.H"
+#include "page_table.H"
 
-#define MAX_NUM_THREADS 32
-#define PAGE_SIZE 2048
+#define CACHE_LINE 64
 
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", 
         "o", "dirty_pages.out", "specify output file name");
 KNOB<double> KnobInsPerSec(KNOB_MODE_WRITEONCE, "pintool", 
         "i", "1e9", "rate of instructions per second for this benchmark");
+KNOB<UINT64> KnobGranularity(KNOB_MODE_APPEND, "pintool",
+        "granularity", "4096", "size in bytes of the units counted as dirty, a power of two; repeat for several");
+KNOB<BOOL> KnobFilter(KNOB_MODE_WRITEONCE, "pintool",
+        "filter", "1", "skip writes to the last two units a thread wrote inline");
+KNOB<UINT64> KnobBudget(KNOB_MODE_WRITEONCE, "pintool",
+        "budget", "16384", "instructions a thread runs before adding them to the global count");
+KNOB<BOOL> KnobNuma(KNOB_MODE_WRITEONCE, "pintool",
+        "numa", "0", "record the first toucher and the accessors of every page, see -numa_o");
+KNOB<UINT64> KnobNumaPage(KNOB_MODE_WRITEONCE, "pintool",
+        "numa_page", "4096", "size in bytes of the pages -numa records, a power of two");
+KNOB<string> KnobNumaFile(KNOB_MODE_WRITEONCE, "pintool",
+        "numa_o", "dirty_pages_numa.out", "output file of -numa");
 
-FILE * out;
+// Written by the writer thread; the rows are queued with lock held
+ASYNC_STREAM * out;
+ASYNC_WRITER writer;
 UINT64 insPerSec = 0;
 PIN_LOCK lock;
-PIN_LOCK pages_lock;
+SAMPLER sampler;
+SELFPROF selfprof;
+STATSEG statseg;
+COALESCER coalescer;
+ROI roi;
 
 INT32 numThreads = 0;
+UINT64 numIntervals = 0;
 UINT64 lastsum = 0;
-UINT64 icount[MAX_NUM_THREADS] = {0};
-set<ADDRINT> pages;
+INT64 budget = 0;
+
+// Granularities as shifts, finest first.  Writes are recorded at the
+// finest one; the others are derived when an interval closes.
+vector<UINT32> granularityShifts;
+UINT32 unitShift = 0;
+
+// -filter, for the analysis routine of coalesced runs
+BOOL filter = TRUE;
+
+// The units written in each interval, see dirty_epochs.H.  Threads
+// start, exit and close intervals with lock held.
+DIRTY_EPOCHS epochs;
+
+// Instructions published by all threads so far
+volatile UINT64 totalIns = 0;
+
+// -numa.  Every read and write is recorded in pageTable by the thread's
+// bit, and counted by page in the thread's PAGE_COUNTS.  Threads are
+// numbered in the order they start; those from 63 on share the last bit.
+// Each interval adds a row per thread to numaOut with the number of pages
+// it shared with every other thread, and Fini adds the pages whose first
+// toucher is not the thread that accessed them most.
+BOOL numa = FALSE;
+UINT32 numaShift = 12;
+PAGE_TABLE pageTable;
+ASYNC_STREAM * numaOut = NULL;
+
+// The counts of every thread ever started, by number, so that they
+// outlive the thread.  Grown under lock; each is only updated by its
+// thread until Fini.
+vector<PAGE_COUNTS *> pageCounts;
+
+// Per-thread state, created when the thread starts.  Analysis routines
+// get it from a tool register, callbacks from Pin TLS.  Allocated on its
+// own cache lines so that the counters written by every basic block are
+// never shared with another thread.
+struct THREAD_DATA
+{
+    // Instructions left before the thread publishes its count
+    INT64 budget;
+    UINT64 icount;
+    THREADID tid;
+
+    // The last two units the thread wrote and the epoch in which they
+    // were known to be in its set.  A write to either of them in the same
+    // epoch has nothing to record.
+    ADDRINT last_unit[2];
+    ADDRINT filter_epoch;
+
+    // Number of the thread in start order and its bit in the page table
+    UINT32 seq;
+    UINT32 numa_bit;
+
+    // -numa: the last page the thread recorded in the epoch numa_epoch,
+    // and the accesses to it not yet added to numa_counts
+    ADDRINT numa_page;
+    ADDRINT numa_epoch;
+    UINT64 numa_run;
+    PAGE_COUNTS * numa_counts;
+
+    DIRTY_UNITS units;
+
+    SELFPROF_THREAD * prof;     // NULL without -selfprof
+    STATSEG_THREAD * stats;     // NULL without -statseg
+};
+
+TLS_KEY tls_key;
+REG tls_reg;
+
+// Running threads, protected by lock
+set<THREAD_DATA *> liveThreads;
 
 // This routine is executed every time a thread is created
 VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    PIN_GetLock(&lock, threadid+1);
+    VOID * mem;
+    if (posix_memalign(&mem, CACHE_LINE, (sizeof(THREAD_DATA) + CACHE_LINE - 1) & ~(CACHE_LINE - 1)))
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    THREAD_DATA * td = new (mem) THREAD_DATA;
+    td->budget = budget;
+    td->tid = threadid;
+    td->icount = 0;
+    td->last_unit[0] = td->last_unit[1] = ~(ADDRINT)0;
+    td->filter_epoch = ~(ADDRINT)0;
+    td->numa_page = ~(ADDRINT)0;
+    td->numa_epoch = ~(ADDRINT)0;
+    td->numa_run = 0;
+    td->numa_counts = NULL;
+    td->prof = selfprof.ThreadStart(threadid);
+    td->stats = statseg.ThreadStart(threadid);
+    PIN_SetThreadData(tls_key, td, threadid);
+    PIN_SetContextReg(ctxt, tls_reg, (ADDRINT)td);
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
 //    fprintf(out, "thread begin %d\n", threadid);
-    fflush(out);
-    numThreads++;
+    td->seq = numThreads++;
+    td->numa_bit = td->seq < PAGE_TABLE_THREADS ? td->seq : PAGE_TABLE_THREADS - 1;
+    if (numa)
+    {
+        td->numa_counts = new PAGE_COUNTS;
+        pageCounts.push_back(td->numa_counts);
+        writer.Printf(numaOut, "# thread %u tid %u\n", td->seq, threadid);
+    }
+    liveThreads.insert(td);
+    epochs.ThreadStart(&td->units);
     PIN_ReleaseLock(&lock);
 
-    ASSERT(numThreads <= MAX_NUM_THREADS, "Maximum number of threads exceeded\n");
+    roi.ThreadStart(threadid, ctxt);
+    sampler.ThreadStart(threadid, ctxt);
 }
 
-// This routine is executed every time a thread is destroyed
-VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+// Counts, for the pages accessed in an interval, the pages each pair of
+// threads shared
+struct SHARING_MATRIX
 {
-    PIN_GetLock(&lock, threadid+1);
- //   fprintf(out, "thread end %d code %d\n", threadid, code);
-    fflush(out);
+    UINT32 n;
+    vector<UINT64> pages;
+
+    VOID operator()(PAGE_ENTRY * e, UINT64 mask)
+    {
+        for (UINT64 mi = mask; mi; mi &= mi - 1)
+        {
+            UINT32 i = __builtin_ctzll(mi);
+            for (UINT64 mj = mi; mj; mj &= mj - 1)
+                pages[i * n + __builtin_ctzll(mj)]++;
+        }
+    }
+};
+
+// Writes the sharing matrix of the interval that just closed.  Called
+// with lock held, after the epoch moved.  A thread that read the old
+// epoch just before it moved may still set its bit in the old set, which
+// then counts in the interval after the next.
+VOID NumaInterval(UINT32 old, UINT64 ins)
+{
+    SHARING_MATRIX m;
+    m.n = numThreads < PAGE_TABLE_THREADS ? numThreads : PAGE_TABLE_THREADS;
+    m.pages.assign(m.n * m.n, 0);
+    pageTable.DrainInterval(old & 1, m);
+
+    writer.Printf(numaOut, "# interval %lu instructions %lu threads %u\n",
+                  numIntervals, ins, m.n);
+    for (UINT32 i = 0; i < m.n; i++)
+    {
+        string row;
+        for (UINT32 j = 0; j < m.n; j++)
+            row += (j ? " " : "") + decstr(j < i ? m.pages[j * m.n + i] : m.pages[i * m.n + j]);
+        row += "\n";
+        writer.Write(numaOut, row.data(), row.size());
+    }
+}
+
+// Closes the current interval; called with lock held.  Writers keep
+// going in the other set while the old ones are merged.  prof is the
+// closing thread's, if it has one.
+VOID CloseInterval(UINT64 ins, THREADID threadid, SELFPROF_THREAD * prof)
+{
+    vector<UINT64> counts;
+    UINT32 old = epochs.Close(granularityShifts, unitShift, counts, threadid, prof);
+
+    string row = decstr(ins);
+    UINT64 dirty = counts[0];
+    for (UINT32 g = 0; g < counts.size(); g++)
+        row += " " + decstr(counts[g]);
+    row += "\n";
+    writer.Write(out, row.data(), row.size());
+    SELFPROF_Bytes(prof, row.size());
+
+    if (numa)
+        NumaInterval(old, ins);
+    numIntervals++;
+    if (statseg.Enabled())
+    {
+        statseg.BeginGlobal();
+        statseg.SetGlobal(STATSEG_INTERVALS, numIntervals);
+        statseg.SetGlobal(STATSEG_INTERVAL_INS, ins);
+        statseg.SetGlobal(STATSEG_INTERVAL_DIRTY, dirty);
+        statseg.SetGlobal(STATSEG_TOTAL_INS, totalIns);
+        statseg.EndGlobal();
+    }
+}
+
+// Region of interest changes.  Closing a window ends the interval in
+// progress, and the next window starts a fresh one.  Called with the ROI
+// lock held, which is always taken before lock.
+VOID RoiChange(BOOL active, UINT32 window, THREADID threadid)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+    SELFPROF_THREAD * prof = td ? td->prof : NULL;
+    SELFPROF_GetLock(prof, &lock, threadid+1);
+    if (active)
+        writer.Printf(out, "# window %u\n", window);
+    else if (totalIns > lastsum)
+        CloseInterval(totalIns - lastsum, threadid, prof);
+    lastsum = totalIns;
     PIN_ReleaseLock(&lock);
 }
 
-// Pin calls this function every time a new instruction is encountered
-VOID PIN_FAST_ANALYSIS_CALL docount(THREADID threadid, ADDRINT c) 
-{ 
-    UINT64 sum = 0;
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
-        sum += icount[t];
-    UINT64 ins = sum - lastsum;
+// Inlined into every basic block: counts down the thread's budget and
+// asks for Publish only when it runs out
+ADDRINT PIN_FAST_ANALYSIS_CALL CountDown(THREAD_DATA * td, ADDRINT c)
+{
+    return (td->budget -= c) <= 0;
+}
+
+// Adds the instructions the thread ran since its last call to the global
+// count and closes the interval if that crossed the boundary
+VOID PIN_FAST_ANALYSIS_CALL Publish(THREAD_DATA * td)
+{
+    SELFPROF_TIMER timer(td->prof);
+    UINT64 used = budget - td->budget;
+    td->budget = budget;
+    td->icount += used;
+    if (td->stats)
+        STATSEG_Publish(td->stats, STATSEG_INSTRUCTIONS, td->icount);
+    UINT64 sum = __sync_add_and_fetch(&totalIns, used);
 
-    if ((ins+c) > insPerSec)
+    // lastsum may have moved past sum in the meantime, the check under the
+    // lock sorts that out.  The closing thread reports the count as it
+    // stands under the lock, so the intervals add up to the total.
+    if ((sum - lastsum) > insPerSec)
     {
-        PIN_GetLock(&lock, threadid+1);
+        SELFPROF_GetLock(td->prof, &lock, td->tid+1);
+        sum = totalIns;
         if ((sum-lastsum) > insPerSec)
         {
-            fprintf(out, "%lu %lu\n", ins+c, pages.size());
+            CloseInterval(sum-lastsum, td->tid, td->prof);
             lastsum = sum;
-            PIN_GetLock(&pages_lock, threadid+1);
-            pages.clear();
-            PIN_ReleaseLock(&pages_lock);
         }
         PIN_ReleaseLock(&lock);
     }
+}
+
+// This routine is executed every time a thread is destroyed
+VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+    Publish(td);
+    statseg.ThreadFini(td->stats);
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
+ //   fprintf(out, "thread end %d code %d\n", threadid, code);
+    epochs.ThreadFini(&td->units);
+    liveThreads.erase(td);
+    if (td->numa_run)
+        td->numa_counts->Add(td->numa_page, td->numa_run);
+    PIN_ReleaseLock(&lock);
+
+    td->~THREAD_DATA();
+    free(td);
+    PIN_SetThreadData(tls_key, 0, threadid);
+    sampler.ThreadFini(threadid, ctxt);
+}
+
+// Marks the finest units from first to last, all under one key.
+// Returns the epoch of the set they are now known to be in.
+static inline UINT32 MarkUnits(THREAD_DATA * td, ADDRINT first, ADDRINT last)
+{
+    return epochs.Mark(&td->units, first >> 6, DIRTY_Bits(first, last), td->prof, td->tid+1);
+}
+
+VOID RecordMemWrite(VOID * ip, ADDRINT addr, UINT32 size, THREAD_DATA * td)
+{
+    SELFPROF_TIMER timer(td->prof);
+    ADDRINT first = addr >> unitShift;
+    ADDRINT last = (addr + (size ? size - 1 : 0)) >> unitShift;
+
+    // Almost always a single unit; a write crossing into the next group
+    // of 64 units is split
+    while ((first >> 6) != (last >> 6))
+    {
+        MarkUnits(td, first, first | 63);
+        first = (first | 63) + 1;
+    }
+    MarkUnits(td, first, last);
+}
+
+// Inlined before every write: nonzero unless the write stays within one
+// of the last two units and the epoch has not moved.  Branch free so
+// that Pin can inline it.
+ADDRINT PIN_FAST_ANALYSIS_CALL WriteFilterMiss(THREAD_DATA * td, ADDRINT addr, ADDRINT size)
+{
+    ADDRINT first = addr >> unitShift;
+    ADDRINT last = (addr + size - 1) >> unitShift;
+    ADDRINT hit = ((first == td->last_unit[0]) | (first == td->last_unit[1])) &
+        (first == last) & (td->filter_epoch == epochs.Epoch());
+    return hit ^ 1;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL FilteredMemWrite(ADDRINT addr, UINT32 size, THREAD_DATA * td)
+{
+    ADDRINT first = addr >> unitShift;
+    ADDRINT last = (addr + (size ? size - 1 : 0)) >> unitShift;
+    if (first != last)
+    {
+        RecordMemWrite(0, addr, size, td);
+        return;
+    }
+
+    SELFPROF_TIMER timer(td->prof);
+    UINT32 e = MarkUnits(td, first, last);
+    if (e != td->filter_epoch)
+    {
+        // Units of an older epoch say nothing about the current set
+        td->last_unit[1] = ~(ADDRINT)0;
+        td->filter_epoch = e;
+    }
+    else if (first != td->last_unit[0])
+        td->last_unit[1] = td->last_unit[0];
+    td->last_unit[0] = first;
+}
+
+// Inlined before every access with -numa: counts the access and returns
+// zero if it is to the page the thread recorded last in this epoch
+ADDRINT PIN_FAST_ANALYSIS_CALL NumaFilterMiss(THREAD_DATA * td, ADDRINT addr)
+{
+    ADDRINT hit = ((addr >> numaShift) == td->numa_page) & (td->numa_epoch == epochs.Epoch());
+    td->numa_run += hit;
+    return hit ^ 1;
+}
+
+// Records an access to a page other than the last one, or the first of
+// an epoch.  An access that crosses into the next page counts for the
+// first one only.
+VOID PIN_FAST_ANALYSIS_CALL NumaAccess(ADDRINT addr, THREAD_DATA * td)
+{
+    SELFPROF_TIMER timer(td->prof);
+    if (td->numa_run)
+        td->numa_counts->Add(td->numa_page, td->numa_run);
+
+    UINT32 e = epochs.Epoch();
+    td->numa_page = addr >> numaShift;
+    td->numa_epoch = e;
+    td->numa_run = 1;
+    pageTable.Touch(td->numa_page, td->numa_bit, e & 1);
+}
+
+VOID InstrumentNuma(INS ins)
+{
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)NumaFilterMiss, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, tls_reg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)NumaAccess, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+}
 
-    icount[threadid] += c; 
+// A coalesced run of writes, the first at addr, each handled as if it
+// had been instrumented on its own
+VOID PIN_FAST_ANALYSIS_CALL RecordRun(ADDRINT addr, const COALESCE_ACCESS * run, UINT32 n,
+                                      THREAD_DATA * td)
+{
+    for (UINT32 i = 0; i < n; i++)
+    {
+        ADDRINT ea = addr + run[i].offset;
+        if (!filter)
+            RecordMemWrite(0, ea, run[i].size, td);
+        else if (WriteFilterMiss(td, ea, run[i].size))
+            FilteredMemWrite(ea, run[i].size, td);
+    }
 }
 
-VOID RecordMemWrite(VOID * ip, ADDRINT addr, THREADID threadid)
+// Instruments one memory operand, if it is written, using a predicated
+// call, i.e. the instrumentation is called iff the instruction will
+// actually be executed.
+//
+// On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
+// prefixed instructions appear as predicated instructions in Pin.
+VOID InstrumentOperand(INS ins, UINT32 memOp)
 {
-    ADDRINT page_addr = addr/PAGE_SIZE;
+    // Note that in some architectures a single memory operand can be 
+    // both read and written (for instance incl (%eax) on IA-32)
+    // In that case we instrument it once for read and once for write.
+    if (INS_MemoryOperandIsWritten(ins, memOp) && filter)
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)WriteFilterMiss, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, tls_reg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_ADDRINT, (ADDRINT)INS_MemoryOperandSize(ins, memOp),
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)FilteredMemWrite, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, INS_MemoryOperandSize(ins, memOp),
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+    else if (INS_MemoryOperandIsWritten(ins, memOp))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
+            IARG_INST_PTR,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, INS_MemoryOperandSize(ins, memOp),
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+}
+
+VOID Instruction(INS ins, VOID *v)
+{
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+    // Iterate over each memory operand of the instruction.
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        InstrumentOperand(ins, memOp);
+}
 
-    set<ADDRINT>::iterator it; 
-    it = pages.find(page_addr);
-    if (it == pages.end())
+// Instruments the writes of a basic block, one call per coalesced run
+VOID InstrumentBbl(BBL bbl)
+{
+    vector<COALESCE_RUN> runs;
+    coalescer.Bbl(bbl, COALESCE_WRITES, runs);
+    for (UINT32 r = 0; r < runs.size(); r++)
     {
-        PIN_GetLock(&pages_lock, threadid+1);
-        pages.insert(page_addr);
-        PIN_ReleaseLock(&pages_lock);
+        const vector<COALESCE_OPERAND> & ops = runs[r].operands;
+        if (ops.size() == 1)
+        {
+            InstrumentOperand(ops[0].ins, ops[0].memOp);
+            continue;
+        }
+        INS_InsertCall(
+            ops[0].ins, IPOINT_BEFORE, (AFUNPTR)RecordRun, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, ops[0].memOp,
+            IARG_PTR, coalescer.Describe(runs[r], COALESCE_WRITES),
+            IARG_UINT32, (UINT32)ops.size(),
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
     }
 }
 
 // Pin calls this function every time a new basic block is encountered
-// It inserts a call to docount
+// It inserts the budget check, and instruments the writes of the trace
+// unless it belongs to a sampling gap.  Nothing is counted outside the
+// region of interest.
 VOID Trace(TRACE trace, VOID  *v)
 {
+    // Outside the region of interest nothing but the triggers
+    if (!roi.InstrumentTrace(trace))
+        return;
+    BOOL sampled = sampler.InstrumentTrace(trace);
+
     // Visit every basic block in the trace
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
-        // Insert a call to docount for every bbl, passing the number of instructions.
-        // IPOINT_ANYWHERE allows Pin to schedule the call anywhere in the bbl to obtain best performance.
-        // Use a fast linkage for the call.
-        BBL_InsertCall(
-                bbl, IPOINT_ANYWHERE, AFUNPTR(docount), IARG_FAST_ANALYSIS_CALL, 
-                IARG_THREAD_ID, 
+        // Count down the thread's budget by the number of instructions in
+        // the bbl; the check is small enough for Pin to inline.  Only when
+        // the budget runs out is Publish called.  Use a fast linkage.
+        BBL_InsertIfCall(
+                bbl, IPOINT_BEFORE, AFUNPTR(CountDown), IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, tls_reg,
                 IARG_UINT32, BBL_NumIns(bbl), 
                 IARG_END);
+        BBL_InsertThenCall(
+                bbl, IPOINT_BEFORE, AFUNPTR(Publish), IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, tls_reg,
+                IARG_END);
+
+        if (sampled && coalescer.Enabled())
+            InstrumentBbl(bbl);
+        else if (sampled)
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                Instruction(ins, v);
+        if (sampled && numa)
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                InstrumentNuma(ins);
     }
 }
 
-// Is called for every instruction and instruments reads and writes
-VOID Instruction(INS ins, VOID *v)
+// Adds the counts of one thread to the pages, and makes it their owner
+// where it has the most accesses so far
+struct PAGE_OWNERS
 {
-    // Instruments memory accesses using a predicated call, i.e.
-    // the instrumentation is called iff the instruction will actually be executed.
-    //
-    // On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
-    // prefixed instructions appear as predicated instructions in Pin.
-    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    UINT32 seq;
+    UINT32 bit;
 
-    // Iterate over each memory operand of the instruction.
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    VOID operator()(UINT64 page, UINT64 count)
     {
-        // Note that in some architectures a single memory operand can be 
-        // both read and written (for instance incl (%eax) on IA-32)
-        // In that case we instrument it once for read and once for write.
-        if (INS_MemoryOperandIsWritten(ins, memOp))
+        PAGE_ENTRY * e = pageTable.Entry(page);
+        e->accesses += count;
+        if (e->first == bit + 1)
+            e->firstAccesses += count;
+        if (count > e->ownerAccesses)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_THREAD_ID,
-                IARG_END);
+            e->owner = seq;
+            e->ownerAccesses = count;
         }
     }
+};
+
+// Lists the pages whose first toucher is not their owner and sums them up
+// by pair of threads
+struct MISPLACED_PAGES
+{
+    UINT64 pages;
+    UINT64 accesses;
+    UINT64 misplaced;
+    UINT64 misplacedAccesses;   // by other threads than the first toucher
+    map<pair<UINT32, UINT32>, UINT64> pairs;
+
+    VOID operator()(UINT64 page, PAGE_ENTRY * e)
+    {
+        pages++;
+        accesses += e->accesses;
+        UINT32 owner = e->owner < PAGE_TABLE_THREADS ? e->owner : PAGE_TABLE_THREADS - 1;
+        if (owner == e->first - 1 || e->ownerAccesses <= e->firstAccesses)
+            return;
+        misplaced++;
+        misplacedAccesses += e->accesses - e->firstAccesses;
+        pairs[make_pair(e->first - 1, e->owner)] += e->accesses - e->firstAccesses;
+        writer.Printf(numaOut, "0x%lx %u %u %lu %lu %lu 0x%lx\n", page << numaShift,
+                      e->first - 1, e->owner, e->firstAccesses, e->ownerAccesses,
+                      e->accesses, (UINT64)e->accessors);
+    }
+};
+
+static bool MoreAccesses(const pair<pair<UINT32, UINT32>, UINT64> & a,
+                         const pair<pair<UINT32, UINT32>, UINT64> & b)
+{
+    return a.second > b.second;
+}
+
+// Finds the owner of every page once all the threads have stopped, writes
+// the misplaced ones to numaOut and prints the summary.  Called with lock
+// held.
+VOID NumaFini()
+{
+    for (set<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); it++)
+    {
+        THREAD_DATA * td = *it;
+        if (td->numa_run)
+            td->numa_counts->Add(td->numa_page, td->numa_run);
+        td->numa_run = 0;
+    }
+    for (UINT32 s = 0; s < pageCounts.size(); s++)
+    {
+        PAGE_OWNERS o;
+        o.seq = s;
+        o.bit = s < PAGE_TABLE_THREADS ? s : PAGE_TABLE_THREADS - 1;
+        pageCounts[s]->ForEach(o);
+    }
+
+    writer.Printf(numaOut, "# misplaced pages: address first_toucher owner "
+                  "first_accesses owner_accesses accesses accessors\n");
+    MISPLACED_PAGES m;
+    m.pages = m.accesses = m.misplaced = m.misplacedAccesses = 0;
+    pageTable.ForEach(m);
+
+    printf("Pages of %lu bytes: %lu, %lu accesses\n", 1UL << numaShift, m.pages, m.accesses);
+    printf("Pages not owned by their first toucher: %lu, %lu accesses by other threads (%.1f%%)\n",
+           m.misplaced, m.misplacedAccesses,
+           m.accesses ? 100.0 * m.misplacedAccesses / m.accesses : 0.0);
+    vector<pair<pair<UINT32, UINT32>, UINT64> > pairs(m.pairs.begin(), m.pairs.end());
+    sort(pairs.begin(), pairs.end(), MoreAccesses);
+    for (UINT32 i = 0; i < pairs.size() && i < 10; i++)
+        printf("  first touched by thread %u, owned by thread %u: %lu accesses\n",
+               pairs[i].first.first, pairs[i].first.second, pairs[i].second);
 }
 
 VOID Fini(INT32 code, VOID *v)
 {
-    fclose(out);
+    // Count what the threads still running have not published yet and
+    // report the last, partial interval
+    PIN_GetLock(&lock, 1);
+    for (set<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); it++)
+    {
+        UINT64 used = budget - (*it)->budget;
+        (*it)->budget = budget;
+        totalIns += used;
+    }
+    if (roi.Active() && totalIns > lastsum)
+    {
+        CloseInterval(totalIns - lastsum, 0, NULL);
+        lastsum = totalIns;
+    }
+    PIN_ReleaseLock(&lock);
+
+    // The sampling summary goes after the rows, once they are all written
+    writer.Close(out);
+    if (numa)
+    {
+        PIN_GetLock(&lock, 1);
+        NumaFini();
+        PIN_ReleaseLock(&lock);
+        writer.Close(numaOut);
+    }
+    writer.Finish();
+    if (sampler.Enabled())
+    {
+        FILE * f = fopen(KnobOutputFile.Value().c_str(), "a");
+        if (f)
+        {
+            sampler.Report(f, "# ");
+            fclose(f);
+        }
+    }
     printf("Number of threads ever exist = %d\n", numThreads); 
+    coalescer.Report(stdout);
+    selfprof.Report(stdout);
+    statseg.Finish();
 }
 
 /* ===================================================================== */
@@ -188,12 +719,94 @@ int main(int argc, char *argv[])
     // Initialize pin
     if (PIN_Init(argc, argv)) return Usage();
 
-    out = fopen(KnobOutputFile.Value().c_str(), "w");
+    for (UINT32 i = 0; i < KnobGranularity.NumberOfValues(); i++)
+    {
+        UINT64 g = KnobGranularity.Value(i);
+        if (g == 0 || (g & (g - 1)) != 0)
+        {
+            fprintf(stderr, "Error: granularity %lu is not a power of two\n", g);
+            return 1;
+        }
+        granularityShifts.push_back(__builtin_ctzll(g));
+    }
+    sort(granularityShifts.begin(), granularityShifts.end());
+    granularityShifts.erase(unique(granularityShifts.begin(), granularityShifts.end()),
+                            granularityShifts.end());
+    unitShift = granularityShifts[0];
+    filter = KnobFilter.Value();
+    numa = KnobNuma.Value();
+    UINT64 page = KnobNumaPage.Value();
+    if (page == 0 || (page & (page - 1)) != 0)
+    {
+        fprintf(stderr, "Error: page size %lu is not a power of two\n", page);
+        return 1;
+    }
+    numaShift = __builtin_ctzll(page);
+    pageTable.SetPageShift(numaShift);
+
+    writer.Start();
+    out = writer.Open(KnobOutputFile.Value().c_str());
+    if (!out)
+        return 1;
+    if (numa)
+    {
+        numaOut = writer.Open(KnobNumaFile.Value().c_str());
+        if (!numaOut)
+            return 1;
+    }
+    if (!selfprof.Start(ASYNC_WRITER::PrintStats, &writer))
+        return 1;
+
+    // The interval counters are published as each interval closes
+    if (!statseg.Start("dirty_pages", 1 << STATSEG_INSTRUCTIONS,
+                       1 << STATSEG_INTERVALS | 1 << STATSEG_INTERVAL_INS |
+                       1 << STATSEG_INTERVAL_DIRTY | 1 << STATSEG_DIRTY_UNIT | 1 << STATSEG_TOTAL_INS))
+        return 1;
+    if (statseg.Enabled())
+    {
+        statseg.BeginGlobal();
+        statseg.SetGlobal(STATSEG_DIRTY_UNIT, 1ULL << unitShift);
+        statseg.EndGlobal();
+    }
+
+    // Each row is the instruction count of the interval followed by the
+    // number of dirty units at each granularity
+    if (granularityShifts.size() > 1)
+    {
+        writer.Printf(out, "# instructions");
+        for (UINT32 g = 0; g < granularityShifts.size(); g++)
+            writer.Printf(out, " %lu", 1UL << granularityShifts[g]);
+        writer.Printf(out, "\n");
+    }
+
+    tls_key = PIN_CreateThreadDataKey(0);
+    tls_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(tls_reg))
+    {
+        fprintf(stderr, "Error: cannot allocate a scratch register\n");
+        return 1;
+    }
+    if (!roi.Init(RoiChange))
+        return 1;
+    if (roi.Enabled() && roi.Active())
+        writer.Printf(out, "# window 0\n");
+    if (!sampler.Init())
+    {
+        fprintf(stderr, "Error: cannot allocate the sampling registers\n");
+        return 1;
+    }
     insPerSec = (UINT64)(KnobInsPerSec.Value()*(double)1e9);
 
+    // A thread may run up to a budget past the interval boundary before it
+    // is noticed, so keep the budget well below the interval length
+    budget = KnobBudget.Value();
+    if (budget < 1)
+        budget = 1;
+    if ((UINT64)budget > insPerSec / 16 && insPerSec >= 16)
+        budget = insPerSec / 16;
+
     // Instrumenting functions
     TRACE_AddInstrumentFunction(Trace, 0);
-    INS_AddInstrumentFunction(Instruction, 0);
 
     // Functions to be called when a thread begins/ends
     PIN_AddThreadStartFunction(ThreadStart, 0);
@@ -0,0 +1,624 @@
+/*
+ *  Combined memory analysis tool: the trace of pinatrace_mt, the
+ *  footprint of memfootprint_mt and the dirty units of dirty_pages from
+ *  one run of the application.
+ *
+ *      pin -t memanalyze_mt.so [-trace 1] [-footprint 1] [-dirty 1] ... -- app
+ *
+ *  Each analysis is a module enabled by its knob.  Whatever modules are
+ *  enabled, every memory operand is instrumented once, with a predicated
+ *  fill of one MEMREF into the thread's Pin trace buffer, and the modules
+ *  only see the records when the buffer is full: each one in turn runs
+ *  over the whole batch in a loop of its own, so the cost of the
+ *  instrumentation is paid once and each module keeps its tables hot for
+ *  a whole buffer.
+ *
+ *  The trace files are those of pinatrace_mt, see trace_file.H.  The
+ *  footprint is reported on stdout in the format of memfootprint_mt.  The
+ *  dirty units go to -dirty_o in the format of trace_analyze: the records
+ *  hold no instruction counts, so intervals are counted in memory
+ *  accesses of all threads, and one closes at the end of the first buffer
+ *  that takes the count past -interval.  At exit every module reports the
+ *  records it consumed and the cycles it spent on them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include "pin.H"
+#include "pinatrace_format.H"
+#include "sampling.H"
+#include "roi.H"
+#include "async_writer.H"
+#include "trace_file.H"
+#include "footprint.H"
+#include "dirty_epochs.H"
+#include "selfprof.H"
+
+KNOB<BOOL> KnobTrace(KNOB_MODE_WRITEONCE, "pintool",
+        "trace", "0", "write the trace files of pinatrace_mt");
+KNOB<string> KnobTraceFormat(KNOB_MODE_WRITEONCE, "pintool",
+        "trace_format", "binary", "trace file format: text, binary or compressed");
+KNOB<BOOL> KnobFootprint(KNOB_MODE_WRITEONCE, "pintool",
+        "footprint", "0", "report the footprint of memfootprint_mt");
+KNOB<BOOL> KnobDirty(KNOB_MODE_WRITEONCE, "pintool",
+        "dirty", "0", "count the dirty units of every interval, see -dirty_o");
+KNOB<string> KnobDirtyFile(KNOB_MODE_WRITEONCE, "pintool",
+        "dirty_o", "memanalyze_dirty.out", "output file of -dirty");
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE, "pintool",
+        "interval", "1000000", "memory accesses of all threads in a -dirty interval");
+KNOB<UINT64> KnobGranularity(KNOB_MODE_APPEND, "pintool",
+        "granularity", "4096", "size in bytes of the units -dirty counts, a power of two; repeat for several");
+KNOB<UINT32> KnobNumPagesInBuffer(KNOB_MODE_WRITEONCE, "pintool",
+        "num_pages_in_buffer", "256", "number of pages in each per-thread trace buffer");
+
+#define MAX_MODULES 3
+
+PIN_LOCK lock;
+SAMPLER sampler;
+ROI roi;
+ASYNC_WRITER writer;
+SELFPROF selfprof;
+
+INT32 numThreads = 0;
+
+BUFFER_ID bufId;
+
+// An analysis.  ThreadStart returns the state the module keeps for a
+// thread, which is passed back to the other calls for that thread;
+// Consume gets the records of every full buffer.  ThreadFini is called
+// when the thread exits or, for the threads still running, at exit before
+// Fini.
+class MODULE
+{
+  public:
+    MODULE(const char * name) : _name(name) {}
+    virtual ~MODULE() {}
+
+    const char * Name() const { return _name; }
+
+    virtual VOID * ThreadStart(THREADID tid, SELFPROF_THREAD * prof) = 0;
+    virtual VOID Consume(VOID * state, const MEMREF * ref, UINT64 numElements,
+                         SELFPROF_THREAD * prof) = 0;
+    virtual VOID ThreadFini(VOID * state, SELFPROF_THREAD * prof) = 0;
+    virtual VOID Fini() = 0;
+
+  private:
+    const char * _name;
+};
+
+// Enabled modules, in the order they see each buffer
+vector<MODULE *> modules;
+
+// Per-thread state, created when the thread starts and reached through Pin TLS
+struct THREAD_DATA
+{
+    THREADID tid;
+    SELFPROF_THREAD * prof;             // NULL without -selfprof
+    VOID * state[MAX_MODULES];
+    UINT64 records;
+    UINT64 cycles[MAX_MODULES];         // spent in each module's Consume
+};
+
+TLS_KEY tls_key;
+
+// Threads not finished yet, and the records and cycles of those that
+// are, by module.  Protected by lock.
+set<THREAD_DATA *> liveThreads;
+UINT64 totalRecords = 0;
+UINT64 moduleCycles[MAX_MODULES];
+
+/* ===================================================================== */
+/* Trace                                                                 */
+/* ===================================================================== */
+
+TRACE_FILES traceFiles(writer);
+
+class TRACE_MODULE : public MODULE
+{
+  public:
+    TRACE_MODULE() : MODULE("trace") {}
+
+    VOID * ThreadStart(THREADID tid, SELFPROF_THREAD * prof)
+    {
+        THREAD_TRACE * t = new THREAD_TRACE;
+        traceFiles.ThreadStart(t, tid, prof);
+        return t;
+    }
+
+    VOID Consume(VOID * state, const MEMREF * ref, UINT64 numElements, SELFPROF_THREAD * prof)
+    {
+        traceFiles.Write(static_cast<THREAD_TRACE *>(state), ref, numElements, prof);
+    }
+
+    VOID ThreadFini(VOID * state, SELFPROF_THREAD * prof)
+    {
+        THREAD_TRACE * t = static_cast<THREAD_TRACE *>(state);
+        traceFiles.Close(t);
+        delete t;
+    }
+
+    VOID Fini() {}
+};
+
+/* ===================================================================== */
+/* Footprint                                                             */
+/* ===================================================================== */
+
+// The addresses of one thread, kept after it exits
+struct FOOTPRINT_THREAD
+{
+    THREADID tid;
+    ADDR_TABLE addrs;
+    UINT64 all_bytes_read;
+};
+
+class FOOTPRINT_MODULE : public MODULE
+{
+  public:
+    FOOTPRINT_MODULE() : MODULE("footprint") {}
+
+    VOID * ThreadStart(THREADID tid, SELFPROF_THREAD * prof)
+    {
+        FOOTPRINT_THREAD * f = new FOOTPRINT_THREAD;
+        f->tid = tid;
+        f->all_bytes_read = 0;
+
+        // Called with lock held
+        _threads.push_back(f);
+        return f;
+    }
+
+    VOID Consume(VOID * state, const MEMREF * ref, UINT64 numElements, SELFPROF_THREAD * prof)
+    {
+        FOOTPRINT_THREAD * f = static_cast<FOOTPRINT_THREAD *>(state);
+        for (UINT64 i = 0; i < numElements; i++)
+        {
+            bool write = (ref[i].flags & PINATRACE_FLAG_WRITE) != 0;
+            f->all_bytes_read += ref[i].size;
+            FOOTPRINT_Count(f->addrs, ref[i].ea, ref[i].size, !write, write);
+        }
+        SELFPROF_Table(prof, f->addrs.Size());
+    }
+
+    VOID ThreadFini(VOID * state, SELFPROF_THREAD * prof) {}
+
+    // Merges the threads' tables into one whose accesses count the
+    // threads that touched each address
+    VOID Fini()
+    {
+        ADDR_TABLE merged;
+        UINT64 total_addrs = 0;
+        UINT64 total_all_bytes_read = 0;
+        for (UINT32 t = 0; t < _threads.size(); t++)
+        {
+            const FOOTPRINT_THREAD * f = _threads[t];
+            printf("Thread %u addrs %lu all_bytes_read %lu\n", f->tid, f->addrs.Size(),
+                   f->all_bytes_read);
+            total_addrs += f->addrs.Size();
+            total_all_bytes_read += f->all_bytes_read;
+
+            for (UINT64 i = 0; i < f->addrs.Size(); i++)
+            {
+                const ADDRSTAT * stat = f->addrs.Record(i);
+                bool created;
+                ADDRSTAT * m = merged.Lookup(stat->addr, &created);
+                if (created)
+                {
+                    m->accesses = 0;
+                    m->is_read = m->is_write = 0;
+                }
+                m->accesses++;
+                m->is_read |= stat->is_read;
+                m->is_write |= stat->is_write;
+            }
+        }
+
+        FOOTPRINT_COUNTS counts;
+        for (UINT64 i = 0; i < merged.Size(); i++)
+        {
+            const ADDRSTAT * m = merged.Record(i);
+            counts.Add(m->accesses, m->is_write != 0);
+        }
+
+        printf("Total addrs %lu\n", total_addrs);
+        counts.Print(stdout);
+        printf("Total all_bytes_read %lu\n", total_all_bytes_read);
+    }
+
+  private:
+    vector<FOOTPRINT_THREAD *> _threads;
+};
+
+/* ===================================================================== */
+/* Dirty units                                                           */
+/* ===================================================================== */
+
+// The units one thread wrote, see dirty_epochs.H.  The thread holds them
+// for a whole buffer.
+struct DIRTY_THREAD
+{
+    THREADID tid;
+    DIRTY_UNITS units;
+};
+
+class DIRTY_MODULE : public MODULE
+{
+  public:
+    DIRTY_MODULE() : MODULE("dirty"), _out(NULL), _unitShift(0), _interval(0), _accesses(0),
+                     _lastsum(0)
+    {}
+
+    // Opens the output file; shifts are the granularities, finest first
+    BOOL Start(const vector<UINT32> & shifts, UINT64 interval)
+    {
+        PIN_InitLock(&_lock);
+        _shifts = shifts;
+        _unitShift = shifts[0];
+        _interval = interval;
+        _out = writer.Open(KnobDirtyFile.Value().c_str());
+        if (!_out)
+            return FALSE;
+
+        // Each row is the number of accesses in the interval followed by
+        // the number of dirty units at each granularity
+        writer.Printf(_out, "# accesses");
+        for (UINT32 g = 0; g < _shifts.size(); g++)
+            writer.Printf(_out, " %lu", 1UL << _shifts[g]);
+        writer.Printf(_out, "\n");
+        return TRUE;
+    }
+
+    VOID * ThreadStart(THREADID tid, SELFPROF_THREAD * prof)
+    {
+        DIRTY_THREAD * d = new DIRTY_THREAD;
+        d->tid = tid;
+
+        SELFPROF_GetLock(prof, &_lock, tid+1);
+        _epochs.ThreadStart(&d->units);
+        PIN_ReleaseLock(&_lock);
+        return d;
+    }
+
+    VOID Consume(VOID * state, const MEMREF * ref, UINT64 numElements, SELFPROF_THREAD * prof)
+    {
+        DIRTY_THREAD * d = static_cast<DIRTY_THREAD *>(state);
+
+        // The epoch cannot move while the set is held, so the whole
+        // buffer goes to one interval
+        DIRTY_SET & units = _epochs.Lock(&d->units, prof, d->tid+1);
+        UINT64 lastKey = ~0ULL, lastBits = 0;
+        for (UINT64 i = 0; i < numElements; i++)
+        {
+            if (!(ref[i].flags & PINATRACE_FLAG_WRITE))
+                continue;
+            ADDRINT first = ref[i].ea >> _unitShift;
+            ADDRINT last = (ref[i].ea + (ref[i].size ? ref[i].size - 1 : 0)) >> _unitShift;
+
+            // Almost always a single unit, often the one written before
+            for (;;)
+            {
+                ADDRINT end = (first >> 6) == (last >> 6) ? last : first | 63;
+                UINT64 key = first >> 6;
+                UINT64 bits = DIRTY_Bits(first, end);
+                if (key != lastKey || (lastBits & bits) != bits)
+                {
+                    units.Insert(key, bits);
+                    lastBits = key == lastKey ? lastBits | bits : bits;
+                    lastKey = key;
+                }
+                if (end == last)
+                    break;
+                first = end + 1;
+            }
+        }
+        _epochs.Unlock(&d->units, prof);
+
+        // lastsum may have moved past sum in the meantime, the check under
+        // the lock sorts that out
+        UINT64 sum = __sync_add_and_fetch(&_accesses, numElements);
+        if (sum - _lastsum >= _interval)
+        {
+            SELFPROF_GetLock(prof, &_lock, d->tid+1);
+            sum = _accesses;
+            if (sum - _lastsum >= _interval)
+            {
+                CloseInterval(sum - _lastsum, d->tid, prof);
+                _lastsum = sum;
+            }
+            PIN_ReleaseLock(&_lock);
+        }
+    }
+
+    VOID ThreadFini(VOID * state, SELFPROF_THREAD * prof)
+    {
+        DIRTY_THREAD * d = static_cast<DIRTY_THREAD *>(state);
+        SELFPROF_GetLock(prof, &_lock, d->tid+1);
+        _epochs.ThreadFini(&d->units);
+        PIN_ReleaseLock(&_lock);
+        delete d;
+    }
+
+    // Reports the last, partial interval
+    VOID Fini()
+    {
+        PIN_GetLock(&_lock, 1);
+        if (_accesses > _lastsum)
+            CloseInterval(_accesses - _lastsum, 0, NULL);
+        _lastsum = _accesses;
+        PIN_ReleaseLock(&_lock);
+        writer.Close(_out);
+    }
+
+  private:
+    // Called with _lock held
+    VOID CloseInterval(UINT64 accesses, THREADID threadid, SELFPROF_THREAD * prof)
+    {
+        vector<UINT64> counts;
+        _epochs.Close(_shifts, _unitShift, counts, threadid, prof);
+
+        string row = decstr(accesses);
+        for (UINT32 g = 0; g < counts.size(); g++)
+            row += " " + decstr(counts[g]);
+        row += "\n";
+        writer.Write(_out, row.data(), row.size());
+        SELFPROF_Bytes(prof, row.size());
+    }
+
+    ASYNC_STREAM * _out;
+    vector<UINT32> _shifts;
+    UINT32 _unitShift;
+    UINT64 _interval;
+
+    // Accesses of all threads so far, and at the end of the last interval
+    volatile UINT64 _accesses;
+    UINT64 _lastsum;
+
+    // Serializes _epochs, see dirty_epochs.H
+    PIN_LOCK _lock;
+    DIRTY_EPOCHS _epochs;
+};
+
+TRACE_MODULE traceModule;
+FOOTPRINT_MODULE footprintModule;
+DIRTY_MODULE dirtyModule;
+
+/* ===================================================================== */
+/* Instrumentation and thread callbacks                                  */
+/* ===================================================================== */
+
+// Called by Pin when a thread's trace buffer fills up, and when the thread
+// exits: hands the records to every module in turn
+VOID * BufferFull(BUFFER_ID id, THREADID threadid, const CONTEXT *ctxt, VOID *buf,
+                  UINT64 numElements, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+    if (numElements == 0)
+        return buf;
+
+    SELFPROF_TIMER timer(td->prof);
+    const MEMREF * ref = (const MEMREF *)buf;
+    td->records += numElements;
+    for (UINT32 m = 0; m < modules.size(); m++)
+    {
+        UINT64 start = SELFPROF_Cycles();
+        modules[m]->Consume(td->state[m], ref, numElements, td->prof);
+        td->cycles[m] += SELFPROF_Cycles() - start;
+    }
+    return buf;
+}
+
+// Finishes the thread in every module and adds up its counts.  Called
+// with lock held.
+VOID FinishThread(THREAD_DATA * td)
+{
+    for (UINT32 m = 0; m < modules.size(); m++)
+    {
+        modules[m]->ThreadFini(td->state[m], td->prof);
+        moduleCycles[m] += td->cycles[m];
+    }
+    totalRecords += td->records;
+    liveThreads.erase(td);
+    delete td;
+}
+
+VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_DATA * td = new THREAD_DATA;
+    td->tid = threadid;
+    td->prof = selfprof.ThreadStart(threadid);
+    td->records = 0;
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
+    numThreads++;
+    liveThreads.insert(td);
+    for (UINT32 m = 0; m < modules.size(); m++)
+    {
+        td->state[m] = modules[m]->ThreadStart(threadid, td->prof);
+        td->cycles[m] = 0;
+    }
+    PIN_ReleaseLock(&lock);
+
+    PIN_SetThreadData(tls_key, td, threadid);
+    roi.ThreadStart(threadid, ctxt);
+    sampler.ThreadStart(threadid, ctxt);
+}
+
+// Pin flushes the thread's trace buffer before calling this
+VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
+    FinishThread(td);
+    PIN_ReleaseLock(&lock);
+
+    PIN_SetThreadData(tls_key, 0, threadid);
+    sampler.ThreadFini(threadid, ctxt);
+}
+
+// Fills one record per read and one per write of every memory operand,
+// whatever the modules enabled; the fill is predicated, so the record is
+// only written if the instruction executes
+VOID Instruction(INS ins, VOID *v)
+{
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    UINT32 window = roi.Window() << PINATRACE_FLAG_WINDOW_SHIFT;
+
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    {
+        const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
+        if (INS_MemoryOperandIsRead(ins, memOp))
+        {
+            INS_InsertFillBufferPredicated(
+                ins, IPOINT_BEFORE, bufId,
+                IARG_INST_PTR, offsetof(MEMREF, ip),
+                IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, ea),
+                IARG_UINT32, size, offsetof(MEMREF, size),
+                IARG_UINT32, window, offsetof(MEMREF, flags),
+                IARG_END);
+        }
+        if (INS_MemoryOperandIsWritten(ins, memOp))
+        {
+            INS_InsertFillBufferPredicated(
+                ins, IPOINT_BEFORE, bufId,
+                IARG_INST_PTR, offsetof(MEMREF, ip),
+                IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, ea),
+                IARG_UINT32, size, offsetof(MEMREF, size),
+                IARG_UINT32, window | PINATRACE_FLAG_WRITE, offsetof(MEMREF, flags),
+                IARG_END);
+        }
+    }
+}
+
+// Instruments the memory accesses of a trace, if it runs inside a region
+// of interest window, and only in the bursts when sampling
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (!roi.InstrumentTrace(trace) || !sampler.InstrumentTrace(trace))
+        return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            Instruction(ins, v);
+}
+
+VOID Fini(INT32 code, VOID *v)
+{
+    printf("Number of threads ever exist = %d\n", numThreads);
+
+    // Threads that were still running when the application exited
+    PIN_GetLock(&lock, 1);
+    while (!liveThreads.empty())
+        FinishThread(*liveThreads.begin());
+    PIN_ReleaseLock(&lock);
+
+    for (UINT32 m = 0; m < modules.size(); m++)
+        modules[m]->Fini();
+    writer.Finish();
+
+    // The cost of each module over the same records
+    for (UINT32 m = 0; m < modules.size(); m++)
+        printf("Module %s records %lu cycles %lu\n", modules[m]->Name(), totalRecords,
+               moduleCycles[m]);
+
+    sampler.Report(stdout, "");
+    selfprof.Report(stdout);
+}
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage()
+{
+    PIN_ERROR( "This Pintool traces and analyzes memory accesses in a single pass\n"
+              + KNOB_BASE::StringKnobSummary() + "\n");
+    return -1;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[])
+{
+    // Initialize pin
+    if (PIN_Init(argc, argv)) return Usage();
+
+    TRACE_FORMAT format;
+    if (!TRACE_ParseFormat(KnobTraceFormat.Value(), &format))
+        return Usage();
+
+    vector<UINT32> granularityShifts;
+    for (UINT32 i = 0; i < KnobGranularity.NumberOfValues(); i++)
+    {
+        UINT64 g = KnobGranularity.Value(i);
+        if (g == 0 || (g & (g - 1)) != 0)
+        {
+            fprintf(stderr, "Error: granularity %lu is not a power of two\n", g);
+            return 1;
+        }
+        granularityShifts.push_back(__builtin_ctzll(g));
+    }
+    sort(granularityShifts.begin(), granularityShifts.end());
+    granularityShifts.erase(unique(granularityShifts.begin(), granularityShifts.end()),
+                            granularityShifts.end());
+    if (KnobInterval.Value() == 0)
+    {
+        fprintf(stderr, "Error: the interval must be at least one access\n");
+        return 1;
+    }
+
+    if (KnobTrace)
+        modules.push_back(&traceModule);
+    if (KnobFootprint)
+        modules.push_back(&footprintModule);
+    if (KnobDirty)
+        modules.push_back(&dirtyModule);
+    if (modules.empty())
+    {
+        fprintf(stderr, "Error: no analysis enabled, use -trace, -footprint or -dirty\n");
+        return 1;
+    }
+
+    bufId = PIN_DefineTraceBuffer(sizeof(MEMREF), KnobNumPagesInBuffer.Value(),
+                                  BufferFull, 0);
+    if (bufId == BUFFER_ID_INVALID)
+    {
+        fprintf(stderr, "Error: could not allocate initial trace buffer\n");
+        return 1;
+    }
+
+    tls_key = PIN_CreateThreadDataKey(0);
+    if (!roi.Init(0))
+        return 1;
+    if (!sampler.Init())
+    {
+        fprintf(stderr, "Error: cannot allocate the sampling registers\n");
+        return 1;
+    }
+
+    PIN_InitLock(&lock);
+    writer.Start();
+    traceFiles.Start(format, roi.Enabled());
+    if (KnobDirty && !dirtyModule.Start(granularityShifts, KnobInterval.Value()))
+        return 1;
+    if (!selfprof.Start(ASYNC_WRITER::PrintStats, &writer))
+        return 1;
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+
+    TRACE_AddInstrumentFunction(Trace, 0);
+    PIN_AddFiniFunction(Fini, 0);
+
+    // Never returns
+    PIN_StartProgram();
+
+    return 0;
+}
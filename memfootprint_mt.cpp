@@ -33,118 +33,1320 @@ END_LEGAL */
 #include <stdio.h>
 #include <stdlib.h>
 #include "pin.H"
+#include <vector>
+#include <algorithm>
 #include <map>
+#include "addr_table.H"
+#include "reuse_distance.H"
+#include "dirty_set.H"
+#include "key_table.H"
+#include "footprint.H"
+#include "sampling.H"
+#include "roi.H"
+#include "selfprof.H"
+#include "statseg.H"
+#include "coalesce.H"
+#include "false_sharing.H"
+#include "stride.H"
 
-#define MAX_NUM_THREADS 8
+KNOB<BOOL> KnobFilter(KNOB_MODE_WRITEONCE, "pintool",
+        "filter", "1", "count repeated accesses to the last address inline instead of in the table");
+KNOB<UINT32> KnobMergeThreads(KNOB_MODE_WRITEONCE, "pintool",
+        "merge_threads", "4", "number of internal threads that help merge the per-thread tables at exit");
+KNOB<string> KnobSharingFile(KNOB_MODE_WRITEONCE, "pintool",
+        "sharing_csv", "memfootprint_sharing.csv", "file for the thread-by-thread sharing matrix, empty for none");
+KNOB<BOOL> KnobReuse(KNOB_MODE_WRITEONCE, "pintool",
+        "reuse", "0", "report reuse distance histograms and miss ratio curves");
+KNOB<UINT64> KnobReuseGranularity(KNOB_MODE_WRITEONCE, "pintool",
+        "reuse_granularity", "64", "size in bytes of the lines reuse distances count, a power of two");
+KNOB<double> KnobReuseRate(KNOB_MODE_WRITEONCE, "pintool",
+        "reuse_rate", "1", "fraction of the lines whose reuse distances are tracked");
+KNOB<UINT32> KnobHotspots(KNOB_MODE_WRITEONCE, "pintool",
+        "hotspots", "0", "report the N instructions and routines with the most accesses, 0 for none");
 
 PIN_LOCK lock;
 PIN_LOCK bytes_lock;
+SAMPLER sampler;
+ROI roi;
+SELFPROF selfprof;
+STATSEG statseg;
+COALESCER coalescer;
+FALSE_SHARING lineWriters;
+STRIDES strides;
 
 INT32 numThreads = 0;
 
-struct ADDRSTAT {
-    UINT32 accesses;
-    UINT32 all_bytes_read;
-    UINT32 smallest_byte_read;
-    UINT32 largest_byte_read;
-    BOOL is_read;
-    BOOL is_write;
+// Reuse distances.  Every thread keeps its own stack; the global one is
+// fed REUSE_BATCH lines at a time from each thread, so the interleaving
+// of the threads in it is only as fine as the batches.
+#define REUSE_BATCH 256
+
+UINT32 reuseShift = 0;
+UINT64 reuseThreshold = 0;          // see REUSE_Sampled
+PIN_LOCK reuse_lock;
+REUSE_STACK * globalReuse = NULL;
+
+// Hot spots.  Every instruction with a memory operand gets a dense slot
+// number the first time it is instrumented, which its analysis calls
+// pass as a constant, so counting is an index into a per-thread array.
+// The lines each slot touched are kept per thread as (slot, line) keys.
+// Fini merges the threads and rolls the slots up to routines and images.
+#define HOTSPOT_LINE_SHIFT 6
+#define HOTSPOT_SLOT_SHIFT 36       // above the line number divided by 64
+
+struct SLOT_COUNTS
+{
+    UINT64 reads;
+    UINT64 writes;
+    UINT64 bytes;
+};
+
+// What is known of a slot at instrumentation time
+struct SLOT_INFO
+{
+    ADDRINT ip;
+    UINT32 rtn;                 // index into routines
+};
+
+struct ROUTINE
+{
+    string name;
+    UINT32 img;                 // index into images
+};
+
+BOOL hotspots = FALSE;
+
+// What each access goes through, from the knobs; Instruction decides the
+// same at instrumentation time, RecordRun for coalesced runs
+BOOL filter = TRUE;
+BOOL reuseAll = FALSE;          // every access goes to the reuse stacks
+BOOL reuseSampled = FALSE;      // only the lines REUSE_Sampled selects
+BOOL falseSharing = FALSE;      // writes also go to lineWriters
+BOOL patterns = FALSE;          // every access goes to the thread's strides
+BOOL slotted = FALSE;           // instructions get slots, for any of the above
+
+// Only used from instrumentation callbacks, which Pin serializes, and Fini
+vector<SLOT_INFO> slots;
+map<ADDRINT, UINT32> slotByIp;
+vector<ROUTINE> routines;
+map<string, UINT32> routineIds;     // by image and routine name
+vector<string> images;
+map<string, UINT32> imageIds;
+
+// What a thread touched in one region of interest window.  Without a
+// region of interest everything is in window 0.
+struct WINDOW_DATA
+{
+    ADDR_TABLE addrs;
+    UINT64 all_bytes_read;
+};
+
+// The last address a thread read or wrote.  Repeats of the same access
+// only bump hits in an inlined check; the hits are added to the record
+// when the entry is replaced or at the end.
+struct FILTER
+{
+    ADDRINT addr;
+    ADDRINT size;
+    ADDRINT window;
+    ADDRINT slot;
+    UINT64 hits;
+    ADDRSTAT * stat;            // the record of addr, which never moves
+    WINDOW_DATA * wd;           // the window the record is in
+};
+
+// Per-thread state, created when the thread starts.  Analysis routines
+// get it from a tool register, callbacks from Pin TLS.  The address
+// tables are kept after the thread exits for the merge at exit.
+struct THREAD_DATA
+{
+    FILTER read_filter;
+    FILTER write_filter;
+    THREADID tid;
+    INT32 seq;                  // order in which the threads started
+    UINT32 current_window;
+    WINDOW_DATA * current;      // windows[current_window]
+    vector<WINDOW_DATA *> windows;  // NULL for windows the thread did not run in
+    REUSE_STACK * reuse;        // NULL without -reuse
+    UINT32 reuse_batched;
+    ADDRINT reuse_batch[REUSE_BATCH];   // lines not yet in globalReuse
+    vector<SLOT_COUNTS> slots;  // by slot, grown on demand
+    DIRTY_SET lines;            // (slot, line) pairs touched
+    vector<STRIDE_STATE> strides;   // by operand number, with -strides
+    SELFPROF_THREAD * prof;     // NULL without -selfprof
+    STATSEG_THREAD * stats;     // NULL without -statseg
+    UINT32 stats_countdown;     // table updates until the next publish
+
+    // -false_sharing: the line the thread wrote last, its entry there, and
+    // the write, repeated fs_hits times since
+    FS_LINE * fs_line;
+    FS_WRITER * fs_writer;
+    ADDRINT fs_addr;
+    ADDRINT fs_size;
+    UINT64 fs_hits;
 };
 
-map <ADDRINT, ADDRSTAT> addrs[MAX_NUM_THREADS];
-UINT64 thread_all_bytes_read[MAX_NUM_THREADS] = {0};
+TLS_KEY tls_key;
+REG tls_reg;
 
-//FILE * trace;
-FILE** trace_files = (FILE **)malloc(sizeof(FILE*) * (MAX_NUM_THREADS));
+// Every thread that ever started, by seq
+vector<THREAD_DATA *> threads;
 
-VOID CountBytes(ADDRINT addr, UINT32 size, THREADID t, BOOL l, BOOL s)
+static WINDOW_DATA * SwitchWindow(THREAD_DATA * td, UINT32 window)
 {
-    thread_all_bytes_read[t] += size;
-    map <ADDRINT, ADDRSTAT>::iterator itr = addrs[t].find(addr);
-    if (itr == addrs[t].end()) {
-        ADDRSTAT new_stat = {1, size, size, size, l, s};
-        addrs[t][addr] = new_stat;
+    if (window >= td->windows.size())
+        td->windows.resize(window + 1, NULL);
+    if (!td->windows[window])
+    {
+        td->windows[window] = new WINDOW_DATA;
+        td->windows[window]->all_bytes_read = 0;
     }
-    else {
-        (itr->second).accesses++;
-        (itr->second).all_bytes_read += size;
-        if (!(itr->second).is_read)
-            (itr->second).is_read = l;
-        if (!(itr->second).is_write)
-            (itr->second).is_write = s;
-        if ((itr->second).smallest_byte_read > size)
-            (itr->second).smallest_byte_read = size;
-        if ((itr->second).largest_byte_read < size)
-            (itr->second).largest_byte_read = size;
+    td->current_window = window;
+    return td->current = td->windows[window];
+}
+
+// The data of the thread for a window, created on first use
+static inline WINDOW_DATA * Window(THREAD_DATA * td, UINT32 window)
+{
+    return window == td->current_window ? td->current : SwitchWindow(td, window);
+}
+
+// Counts an access of a slot, with -hotspots
+static VOID CountSlot(THREAD_DATA * td, UINT32 slot, ADDRINT addr, UINT32 size, BOOL write)
+{
+    if (!hotspots)
+        return;
+    if (slot >= td->slots.size())
+    {
+        SLOT_COUNTS zero = { 0, 0, 0 };
+        td->slots.resize(slot * 2 + 64, zero);
+    }
+    SLOT_COUNTS & c = td->slots[slot];
+    c.reads += !write;
+    c.writes += write;
+    c.bytes += size;
+
+    UINT64 line = addr >> HOTSPOT_LINE_SHIFT;
+    td->lines.Insert((UINT64)slot << HOTSPOT_SLOT_SHIFT | line >> 6, 1ULL << (line & 63));
+}
+
+ADDRSTAT * CountBytes(ADDRINT addr, UINT32 size, WINDOW_DATA * wd, BOOL l, BOOL s)
+{
+    wd->all_bytes_read += size;
+    return FOOTPRINT_Count(wd->addrs, addr, size, l, s);
+}
+
+// Adds the hits of a filter entry to its record, and its slot, and
+// empties it
+VOID FlushFilter(THREAD_DATA * td, FILTER * f)
+{
+    if (f->hits)
+    {
+        f->stat->accesses += f->hits;
+        f->stat->all_bytes_read += f->hits * f->size;
+        f->wd->all_bytes_read += f->hits * f->size;
+        if (hotspots)
+        {
+            SLOT_COUNTS & c = td->slots[f->slot];
+            (f == &td->write_filter ? c.writes : c.reads) += f->hits;
+            c.bytes += f->hits * f->size;
+        }
     }
+    f->addr = 0;
+    f->size = 0;
+    f->window = 0;
+    f->slot = 0;
+    f->hits = 0;
+    f->stat = NULL;
+    f->wd = NULL;
+}
+
+// Replaces a filter entry with an access that has just been counted
+static inline VOID FillFilter(THREAD_DATA * td, FILTER * f, ADDRINT addr, UINT32 size,
+                              UINT32 window, UINT32 slot, WINDOW_DATA * wd, ADDRSTAT * stat)
+{
+    FlushFilter(td, f);
+    f->addr = addr;
+    f->size = size;
+    f->window = window;
+    f->slot = slot;
+    f->stat = stat;
+    f->wd = wd;
+}
+
+// Inlined before every access: counts a repeat of the last access and
+// returns nonzero only when the table has to be updated.  Branch free so
+// that Pin can inline it.
+ADDRINT PIN_FAST_ANALYSIS_CALL ReadFilterMiss(THREAD_DATA * td, ADDRINT addr, ADDRINT size,
+                                              ADDRINT window, ADDRINT slot)
+{
+    ADDRINT hit = (td->read_filter.addr == addr) & (td->read_filter.size == size) &
+        (td->read_filter.window == window) & (td->read_filter.slot == slot);
+    td->read_filter.hits += hit;
+    return hit ^ 1;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL WriteFilterMiss(THREAD_DATA * td, ADDRINT addr, ADDRINT size,
+                                               ADDRINT window, ADDRINT slot)
+{
+    ADDRINT hit = (td->write_filter.addr == addr) & (td->write_filter.size == size) &
+        (td->write_filter.window == window) & (td->write_filter.slot == slot);
+    td->write_filter.hits += hit;
+    return hit ^ 1;
+}
+
+// With -statseg, a thread publishes the size and bytes of its table for
+// the current window every PUBLISH_UPDATES table updates.  Filter hits
+// only show once they are flushed.
+#define PUBLISH_UPDATES 1024
+
+static inline VOID PublishStats(THREAD_DATA * td, WINDOW_DATA * wd)
+{
+    if (!td->stats || --td->stats_countdown != 0)
+        return;
+    td->stats_countdown = PUBLISH_UPDATES;
+    STATSEG_WriteBegin(&td->stats->seq);
+    td->stats->counters[STATSEG_BYTES] = wd->all_bytes_read;
+    td->stats->counters[STATSEG_UNIQUE_ADDRS] = wd->addrs.Size();
+    STATSEG_WriteEnd(&td->stats->seq);
 }
 
 // Print a memory read record
-VOID RecordMemRead(VOID * ip, ADDRINT addr, UINT32 size, THREADID threadid)
+VOID RecordMemRead(UINT32 slot, ADDRINT addr, UINT32 size, THREAD_DATA * td, UINT32 window)
 {
-    //fprintf(trace_files[threadid],"%p: R %lu %u\n", ip, addr, size);
+    SELFPROF_TIMER timer(td->prof);
+    WINDOW_DATA * wd = Window(td, window);
     //PIN_GetLock(&bytes_lock, threadid+1);
-    CountBytes(addr, size, threadid, 1, 0);
+    CountBytes(addr, size, wd, 1, 0);
+    CountSlot(td, slot, addr, size, FALSE);
+    SELFPROF_Table(td->prof, wd->addrs.Size());
+    PublishStats(td, wd);
     //PIN_ReleaseLock(&bytes_lock);
 }
 
 // Print a memory write record
-VOID RecordMemWrite(VOID * ip, ADDRINT addr, UINT32 size, THREADID threadid)
+VOID RecordMemWrite(UINT32 slot, ADDRINT addr, UINT32 size, THREAD_DATA * td, UINT32 window)
 {
-    //fprintf(trace_files[threadid],"%p: W %lu %u\n", ip, addr, size);
+    SELFPROF_TIMER timer(td->prof);
+    WINDOW_DATA * wd = Window(td, window);
     //PIN_GetLock(&bytes_lock, threadid+1);
-    CountBytes(addr, size, threadid, 0, 1);
+    CountBytes(addr, size, wd, 0, 1);
+    CountSlot(td, slot, addr, size, TRUE);
+    SELFPROF_Table(td->prof, wd->addrs.Size());
+    PublishStats(td, wd);
     //PIN_ReleaseLock(&bytes_lock);
 }
 
+// Filter misses: count the access and make it the one to repeat
+VOID PIN_FAST_ANALYSIS_CALL FilteredMemRead(ADDRINT addr, UINT32 size, THREAD_DATA * td,
+                                            UINT32 window, UINT32 slot)
+{
+    SELFPROF_TIMER timer(td->prof);
+    WINDOW_DATA * wd = Window(td, window);
+    CountSlot(td, slot, addr, size, FALSE);
+    FillFilter(td, &td->read_filter, addr, size, window, slot, wd,
+               CountBytes(addr, size, wd, 1, 0));
+    SELFPROF_Table(td->prof, wd->addrs.Size());
+    PublishStats(td, wd);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL FilteredMemWrite(ADDRINT addr, UINT32 size, THREAD_DATA * td,
+                                             UINT32 window, UINT32 slot)
+{
+    SELFPROF_TIMER timer(td->prof);
+    WINDOW_DATA * wd = Window(td, window);
+    CountSlot(td, slot, addr, size, TRUE);
+    FillFilter(td, &td->write_filter, addr, size, window, slot, wd,
+               CountBytes(addr, size, wd, 0, 1));
+    SELFPROF_Table(td->prof, wd->addrs.Size());
+    PublishStats(td, wd);
+}
+
+// Adds the thread's batch of lines to the global reuse stack
+VOID FlushReuse(THREAD_DATA * td)
+{
+    SELFPROF_GetLock(td->prof, &reuse_lock, td->tid+1);
+    for (UINT32 i = 0; i < td->reuse_batched; i++)
+        globalReuse->Access(td->reuse_batch[i]);
+    PIN_ReleaseLock(&reuse_lock);
+    td->reuse_batched = 0;
+}
+
+// Inlined before every access when sampling reuse distances: selects the
+// lines that are tracked
+ADDRINT PIN_FAST_ANALYSIS_CALL ReuseSampled(ADDRINT addr)
+{
+    return REUSE_Sampled(addr >> reuseShift, reuseThreshold);
+}
+
+// An access that straddles two lines only counts for the first
+VOID PIN_FAST_ANALYSIS_CALL RecordReuse(ADDRINT addr, THREAD_DATA * td)
+{
+    SELFPROF_TIMER timer(td->prof);
+    ADDRINT line = addr >> reuseShift;
+    td->reuse->Access(line);
+    td->reuse_batch[td->reuse_batched++] = line;
+    if (td->reuse_batched == REUSE_BATCH)
+        FlushReuse(td);
+}
+
+// Adds the repeats of the last write to the thread's entry in its line
+static VOID FlushLineHits(THREAD_DATA * td)
+{
+    if (td->fs_hits)
+        td->fs_writer->writes += td->fs_hits;
+    td->fs_hits = 0;
+}
+
+// Inlined before every write with -false_sharing: counts a repeat of the
+// thread's last write as long as no other thread wrote the line since,
+// and returns nonzero only when the line table has to be updated
+ADDRINT PIN_FAST_ANALYSIS_CALL LineWriteMiss(THREAD_DATA * td, ADDRINT addr, ADDRINT size)
+{
+    ADDRINT hit = (td->fs_addr == addr) & (td->fs_size == size) &
+        (td->fs_line->last == (UINT32)td->seq + 1);
+    td->fs_hits += hit;
+    return hit ^ 1;
+}
+
+// A write that crosses into the next line counts in both, and is never
+// filtered
+VOID PIN_FAST_ANALYSIS_CALL RecordLineWrite(ADDRINT addr, UINT32 size, THREAD_DATA * td,
+                                            UINT32 slot)
+{
+    SELFPROF_TIMER timer(td->prof);
+    FlushLineHits(td);
+    ADDRINT end = addr + (size ? size : 1);
+    for (ADDRINT a = addr; a < end; a = (a | 63) + 1)
+    {
+        ADDRINT next = (a | 63) + 1;
+        UINT32 n = (next < end ? next : end) - a;
+        td->fs_line = lineWriters.Write(a >> FS_LINE_SHIFT, FS_Bytes(a, n), td->seq, slot,
+                                        &td->fs_writer, td->prof);
+    }
+    if (!td->fs_writer || (addr >> FS_LINE_SHIFT) != ((end - 1) >> FS_LINE_SHIFT))
+        td->fs_line = lineWriters.None();
+    td->fs_addr = addr;
+    td->fs_size = size;
+}
+
+// Every access with -strides.  chase is set for 8-byte loads, which may
+// load pointers.
+VOID PIN_FAST_ANALYSIS_CALL RecordStride(ADDRINT addr, UINT32 operand, UINT32 chase,
+                                         THREAD_DATA * td)
+{
+    SELFPROF_TIMER timer(td->prof);
+    STRIDE_Access(STRIDES::State(td->strides, operand), addr, chase);
+}
+
+// A coalesced run of accesses, the first at addr.  Every access goes
+// through the same calls as if it had been instrumented on its own.
+VOID PIN_FAST_ANALYSIS_CALL RecordRun(ADDRINT addr, const COALESCE_ACCESS * run, UINT32 n,
+                                      THREAD_DATA * td, UINT32 window)
+{
+    for (UINT32 i = 0; i < n; i++)
+    {
+        const COALESCE_ACCESS & a = run[i];
+        ADDRINT ea = addr + a.offset;
+        if (reuseAll || (reuseSampled && ReuseSampled(ea)))
+            RecordReuse(ea, td);
+        if (patterns)
+            RecordStride(ea, a.operand, a.read && !a.write && a.size == sizeof(ADDRINT), td);
+
+        if (a.read && filter)
+        {
+            if (ReadFilterMiss(td, ea, a.size, window, a.slot))
+                FilteredMemRead(ea, a.size, td, window, a.slot);
+        }
+        else if (a.read)
+            RecordMemRead(a.slot, ea, a.size, td, window);
+
+        if (a.write && filter)
+        {
+            if (WriteFilterMiss(td, ea, a.size, window, a.slot))
+                FilteredMemWrite(ea, a.size, td, window, a.slot);
+        }
+        else if (a.write)
+            RecordMemWrite(a.slot, ea, a.size, td, window);
+
+        if (a.write && falseSharing && LineWriteMiss(td, ea, a.size))
+            RecordLineWrite(ea, a.size, td, a.slot);
+    }
+}
+
 VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    PIN_InitLock(&lock);
-    PIN_GetLock(&lock, threadid+1);
-    numThreads++;
+    THREAD_DATA * td = new THREAD_DATA;
+    td->tid = threadid;
+    td->current_window = ~0U;
+    td->current = NULL;
+    td->read_filter.hits = td->write_filter.hits = 0;
+    FlushFilter(td, &td->read_filter);
+    FlushFilter(td, &td->write_filter);
+    td->reuse = KnobReuse ? new REUSE_STACK(1 / KnobReuseRate.Value()) : NULL;
+    td->reuse_batched = 0;
+    td->prof = selfprof.ThreadStart(threadid);
+    td->stats = statseg.ThreadStart(threadid);
+    td->stats_countdown = 1;
+    td->fs_line = lineWriters.None();
+    td->fs_writer = NULL;
+    td->fs_addr = td->fs_size = 0;
+    td->fs_hits = 0;
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
+    td->seq = numThreads++;
+    threads.push_back(td);
+    PIN_ReleaseLock(&lock);
+
+    PIN_SetThreadData(tls_key, td, threadid);
+    PIN_SetContextReg(ctxt, tls_reg, (ADDRINT)td);
+    roi.ThreadStart(threadid, ctxt);
+    sampler.ThreadStart(threadid, ctxt);
+}
+
+VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+    FlushFilter(td, &td->read_filter);
+    FlushFilter(td, &td->write_filter);
+    if (td->reuse)
+        FlushReuse(td);
+    FlushLineHits(td);
+    if (td->stats && td->current)
+    {
+        td->stats_countdown = 1;
+        PublishStats(td, td->current);
+    }
+    statseg.ThreadFini(td->stats);
+
+    // The table stays in threads[] until the merge at exit
+    PIN_SetThreadData(tls_key, 0, threadid);
+    sampler.ThreadFini(threadid, ctxt);
+}
+
+/* ===================================================================== */
+/* Cross-thread merge                                                    */
+/* ===================================================================== */
+
+// The merge runs from the PrepareForFini callback, while the internal
+// threads are still alive, shared between the exiting thread and
+// KnobMergeThreads workers.  Scatter splits every thread's table into
+// chunks and copies each address into one of MERGE_PARTITIONS buckets by
+// hash.  Reduce sorts a partition by window and address and walks the
+// runs of threads that touched the same address in a window.  The
+// partitions are taken in rounds of at most about MERGE_ROUND_RECORDS
+// addresses: every round scans the tables again but only copies the
+// addresses of its own partitions, which are reduced and freed before
+// the next round, so the copies never hold the whole footprint.  Work is
+// handed out with atomic counters, so Fini finishes the merge on its own
+// if PrepareForFini never ran.
+//
+// The sharing matrix is built from the distinct sets of threads that
+// share addresses, each counted once in MERGE_GROUPS, so it costs the
+// square of the threads per set rather than per address.
+
+#define MERGE_PARTITIONS 256
+#define MERGE_PARTITION_SHIFT 56
+#define MERGE_CHUNK_RECORDS 65536
+#define MERGE_ROUND_RECORDS (1ULL << 24)
+
+#define MERGE_READ  1
+#define MERGE_WRITE 2
+
+#define MERGE_WINDOW_SHIFT 2
+
+struct MERGE_ENTRY
+{
+    ADDRINT addr;
+    UINT32 seq;
+    UINT32 access;              // MERGE_READ | MERGE_WRITE | window << MERGE_WINDOW_SHIFT
+};
+
+static bool operator<(const MERGE_ENTRY & a, const MERGE_ENTRY & b)
+{
+    UINT32 wa = a.access >> MERGE_WINDOW_SHIFT;
+    UINT32 wb = b.access >> MERGE_WINDOW_SHIFT;
+    return wa < wb || (wa == wb && (a.addr < b.addr || (a.addr == b.addr && a.seq < b.seq)));
+}
+
+struct MERGE_CHUNK
+{
+    UINT32 seq;
+    UINT32 window;
+    UINT64 first;
+    UINT64 last;
+};
+
+struct MERGE_GROUP
+{
+    UINT64 first;               // in MERGE_GROUPS::seqs
+    UINT32 size;
+    UINT64 addrs;               // shared by exactly these threads
+};
+
+// The sets of threads that touched the same addresses, found by a hash of
+// the set.  A set whose hash is taken by another one goes under the next
+// free key.
+struct MERGE_GROUPS
+{
+    KEY_TABLE ids;              // index + 1 in groups
+    vector<UINT32> seqs;        // the sets, one after the other
+    vector<MERGE_GROUP> groups;
+
+    // Counts an address shared by the threads of a run of entries
+    VOID Add(const MERGE_ENTRY * run, UINT32 size)
+    {
+        UINT64 h = size;
+        for (UINT32 i = 0; i < size; i++)
+            h = (h ^ run[i].seq) * 0x100000001b3ULL;
+
+        // Below the top bit, so that a key never wraps to KEY_TABLE's empty slot
+        for (UINT64 key = h >> 1; ; key++)
+        {
+            UINT64 * id = ids.Lookup(key);
+            if (*id == 0)
+            {
+                MERGE_GROUP g;
+                g.first = seqs.size();
+                g.size = size;
+                g.addrs = 1;
+                for (UINT32 i = 0; i < size; i++)
+                    seqs.push_back(run[i].seq);
+                groups.push_back(g);
+                *id = groups.size();
+                return;
+            }
+
+            MERGE_GROUP & g = groups[*id - 1];
+            if (g.size != size)
+                continue;
+            UINT32 i = 0;
+            while (i < size && seqs[g.first + i] == run[i].seq)
+                i++;
+            if (i == size)
+            {
+                g.addrs++;
+                return;
+            }
+        }
+    }
+
+    // Every pair of threads in a set shares its addresses
+    VOID AddSharing(vector<UINT64> & sharing, UINT32 n) const
+    {
+        for (size_t k = 0; k < groups.size(); k++)
+        {
+            const MERGE_GROUP & g = groups[k];
+            for (UINT32 i = 0; i < g.size; i++)
+                for (UINT32 j = 0; j < g.size; j++)
+                    sharing[seqs[g.first + i] * n + seqs[g.first + j]] += g.addrs;
+        }
+    }
+};
+
+// Merged counts of one window by one participant
+struct MERGE_RESULT : FOOTPRINT_COUNTS
+{
+    MERGE_GROUPS groups;        // only with a sharing file
+};
+
+// Everything one merge participant produces
+struct MERGE_OUTPUT
+{
+    vector<MERGE_ENTRY> buckets[MERGE_PARTITIONS];
+    vector<MERGE_RESULT *> results;     // by window
+};
+
+// Progress of the participants through one round
+struct MERGE_ROUND
+{
+    volatile UINT32 nextChunk;
+    volatile UINT32 chunksDone;
+    volatile UINT32 nextPartition;
+};
+
+vector<MERGE_CHUNK> mergeChunks;
+vector<MERGE_ROUND> mergeRounds;
+UINT32 mergePartitionsPerRound;
+UINT32 mergeThreads = 0;                // threads in the merge
+BOOL mergeSharing = FALSE;
+vector<MERGE_OUTPUT *> mergeOutputs;    // workers first, the exiting thread last
+vector<PIN_THREAD_UID> mergeUids;
+PIN_SEMAPHORE mergeStart;
+BOOL merged = FALSE;
+
+static VOID Scatter(MERGE_OUTPUT * out, const MERGE_CHUNK & chunk, UINT32 round)
+{
+    const ADDR_TABLE & addrs = threads[chunk.seq]->windows[chunk.window]->addrs;
+    UINT32 partFirst = round * mergePartitionsPerRound;
+    for (UINT64 i = chunk.first; i < chunk.last; i++)
+    {
+        const ADDRSTAT * stat = addrs.Record(i);
+        UINT32 part = ADDR_TABLE::Hash(stat->addr) >> MERGE_PARTITION_SHIFT;
+        if (part - partFirst >= mergePartitionsPerRound)
+            continue;
+
+        MERGE_ENTRY e;
+        e.addr = stat->addr;
+        e.seq = chunk.seq;
+        e.access = (stat->is_read ? MERGE_READ : 0) | (stat->is_write ? MERGE_WRITE : 0) |
+            chunk.window << MERGE_WINDOW_SHIFT;
+        out->buckets[part].push_back(e);
+    }
+}
+
+static VOID Reduce(MERGE_OUTPUT * out, UINT32 part)
+{
+    vector<MERGE_ENTRY> entries;
+    size_t total = 0;
+    for (UINT32 w = 0; w < mergeOutputs.size(); w++)
+        total += mergeOutputs[w]->buckets[part].size();
+    entries.reserve(total);
+    for (UINT32 w = 0; w < mergeOutputs.size(); w++)
+    {
+        vector<MERGE_ENTRY> & bucket = mergeOutputs[w]->buckets[part];
+        entries.insert(entries.end(), bucket.begin(), bucket.end());
+        vector<MERGE_ENTRY>().swap(bucket);
+    }
+    sort(entries.begin(), entries.end());
+
+    for (size_t first = 0; first < entries.size(); )
+    {
+        size_t last = first;
+        UINT32 window = entries[first].access >> MERGE_WINDOW_SHIFT;
+        UINT32 access = 0;
+        for (; last < entries.size() && entries[last].addr == entries[first].addr &&
+                 (entries[last].access >> MERGE_WINDOW_SHIFT) == window; last++)
+        {
+            access |= entries[last].access;
+        }
+
+        MERGE_RESULT * r = out->results[window];
+        r->Add(last - first, (access & MERGE_WRITE) != 0);
+
+        // A thread has one table per window, so the run holds every
+        // sharer once, in order
+        if (mergeSharing)
+            r->groups.Add(&entries[first], last - first);
+        first = last;
+    }
+}
+
+// Runs whatever merge work is left; called by the workers and by the
+// exiting thread
+static VOID RunMerge(MERGE_OUTPUT * out)
+{
+    for (UINT32 r = 0; r < mergeRounds.size(); r++)
+    {
+        MERGE_ROUND & round = mergeRounds[r];
+        UINT32 c;
+        while ((c = __sync_fetch_and_add(&round.nextChunk, 1)) < mergeChunks.size())
+        {
+            Scatter(out, mergeChunks[c], r);
+            __sync_fetch_and_add(&round.chunksDone, 1);
+        }
+
+        // Reduce needs every bucket of the round filled
+        while (round.chunksDone < mergeChunks.size())
+            PIN_Yield();
+
+        UINT32 p;
+        while ((p = __sync_fetch_and_add(&round.nextPartition, 1)) < mergePartitionsPerRound)
+            Reduce(out, r * mergePartitionsPerRound + p);
+    }
+}
+
+static VOID MergeWorker(VOID * arg)
+{
+    PIN_SemaphoreWait(&mergeStart);
+    RunMerge(static_cast<MERGE_OUTPUT *>(arg));
+}
+
+// Splits the tables into chunks and the partitions into rounds, then
+// merges, with the workers if they are still there.  Threads that are
+// still running when the process exits are merged with the addresses
+// they had so far.
+static VOID MergeTables(UINT32 numWindows, BOOL workers)
+{
+    PIN_GetLock(&lock, PIN_ThreadId()+1);
+    mergeThreads = threads.size();
+    UINT64 records = 0;
+    for (UINT32 i = 0; i < mergeThreads; i++)
+    {
+        THREAD_DATA * td = threads[i];
+        for (UINT32 w = 0; w < td->windows.size() && w < numWindows; w++)
+        {
+            const ADDR_TABLE * addrs = td->windows[w] ? &td->windows[w]->addrs : NULL;
+            for (UINT64 first = 0; addrs && first < addrs->Size(); first += MERGE_CHUNK_RECORDS)
+            {
+                MERGE_CHUNK chunk;
+                chunk.seq = i;
+                chunk.window = w;
+                chunk.first = first;
+                chunk.last = first + MERGE_CHUNK_RECORDS;
+                if (chunk.last > addrs->Size())
+                    chunk.last = addrs->Size();
+                records += chunk.last - chunk.first;
+                mergeChunks.push_back(chunk);
+            }
+        }
+    }
     PIN_ReleaseLock(&lock);
 
-    ASSERT(numThreads <= MAX_NUM_THREADS, "Maximum number of threads exceeded\n");
+    UINT32 rounds = 1;
+    while (rounds < MERGE_PARTITIONS && records > rounds * MERGE_ROUND_RECORDS)
+        rounds *= 2;
+    mergePartitionsPerRound = MERGE_PARTITIONS / rounds;
+    MERGE_ROUND start = { 0, 0, 0 };
+    mergeRounds.assign(rounds, start);
+
+    mergeSharing = !KnobSharingFile.Value().empty();
+    for (UINT32 o = 0; o < mergeOutputs.size(); o++)
+    {
+        for (UINT32 w = 0; w < numWindows; w++)
+            mergeOutputs[o]->results.push_back(new MERGE_RESULT);
+    }
+
+    if (workers)
+        PIN_SemaphoreSet(&mergeStart);
+    RunMerge(mergeOutputs.back());
+    for (UINT32 w = 0; workers && w < mergeUids.size(); w++)
+        PIN_WaitForThreadTermination(mergeUids[w], PIN_INFINITE_TIMEOUT, NULL);
+    merged = TRUE;
+}
+
+// Merges while the workers can still run
+static VOID PrepareForFini(VOID * v)
+{
+    MergeTables(roi.NumWindows(), TRUE);
+}
+
+static VOID WriteSharing(const char * name, const vector<UINT64> & sharing)
+{
+    FILE * f = fopen(name, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        return;
+    }
+
+    UINT32 n = mergeThreads;
+    fprintf(f, "tid");
+    for (UINT32 j = 0; j < n; j++)
+        fprintf(f, ",%u", threads[j]->tid);
+    fprintf(f, "\n");
+    for (UINT32 i = 0; i < n; i++)
+    {
+        fprintf(f, "%u", threads[i]->tid);
+        for (UINT32 j = 0; j < n; j++)
+            fprintf(f, ",%lu", sharing[i * n + j]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+static UINT32 NameId(vector<string> & names, map<string, UINT32> & ids, const string & name)
+{
+    map<string, UINT32>::iterator it = ids.find(name);
+    if (it != ids.end())
+        return it->second;
+    ids[name] = names.size();
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+// The slot of an instruction, assigned the first time it is seen along
+// with the names of its routine and image
+static UINT32 SlotOf(INS ins)
+{
+    ADDRINT ip = INS_Address(ins);
+    map<ADDRINT, UINT32>::iterator it = slotByIp.find(ip);
+    if (it != slotByIp.end())
+        return it->second;
+
+    IMG img = IMG_FindByAddress(ip);
+    string rtnName = RTN_FindNameByAddress(ip);
+    UINT32 imgId = NameId(images, imageIds, IMG_Valid(img) ? IMG_Name(img) : "?");
+    if (rtnName.empty())
+        rtnName = "?";
+
+    string key = decstr(imgId) + ":" + rtnName;
+    UINT32 rtnId;
+    if (routineIds.count(key))
+        rtnId = routineIds[key];
+    else
+    {
+        ROUTINE rtn;
+        rtn.name = rtnName;
+        rtn.img = imgId;
+        rtnId = routineIds[key] = routines.size();
+        routines.push_back(rtn);
+    }
+
+    SLOT_INFO info;
+    info.ip = ip;
+    info.rtn = rtnId;
+    slotByIp[ip] = slots.size();
+    slots.push_back(info);
+    return slots.size() - 1;
+}
+
+// Instruments one memory operand using a predicated call, i.e. the
+// instrumentation is called iff the instruction will actually be executed.
+//
+// On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
+// prefixed instructions appear as predicated instructions in Pin.
+VOID InstrumentOperand(INS ins, UINT32 memOp, UINT32 window, UINT32 slot)
+{
+    const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
+    // One reuse access per operand, even if it is both read and written
+    if (reuseSampled)
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)ReuseSampled, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordReuse, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+    else if (reuseAll)
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordReuse, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+
+    if (patterns)
+    {
+        BOOL chase = INS_MemoryOperandIsRead(ins, memOp) &&
+            !INS_MemoryOperandIsWritten(ins, memOp) && size == sizeof(ADDRINT);
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordStride, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, strides.Operand(slot, memOp),
+            IARG_UINT32, (UINT32)chase,
+            IARG_REG_VALUE, tls_reg,
+            IARG_END);
+    }
+
+    if (INS_MemoryOperandIsRead(ins, memOp) && filter)
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)ReadFilterMiss, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, tls_reg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_ADDRINT, (ADDRINT)size,
+            IARG_ADDRINT, (ADDRINT)window,
+            IARG_ADDRINT, (ADDRINT)slot,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)FilteredMemRead, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, size,
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, window,
+            IARG_UINT32, slot,
+            IARG_END);
+    }
+    else if (INS_MemoryOperandIsRead(ins, memOp))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
+            IARG_UINT32, slot,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, size, 
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, window,
+            IARG_END);
+    }
+    // Note that in some architectures a single memory operand can be 
+    // both read and written (for instance incl (%eax) on IA-32)
+    // In that case we instrument it once for read and once for write.
+    if (INS_MemoryOperandIsWritten(ins, memOp) && filter)
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)WriteFilterMiss, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, tls_reg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_ADDRINT, (ADDRINT)size,
+            IARG_ADDRINT, (ADDRINT)window,
+            IARG_ADDRINT, (ADDRINT)slot,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)FilteredMemWrite, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, size,
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, window,
+            IARG_UINT32, slot,
+            IARG_END);
+    }
+    else if (INS_MemoryOperandIsWritten(ins, memOp))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
+            IARG_UINT32, slot,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, size, 
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, window,
+            IARG_END);
+    }
+
+    if (falseSharing && INS_MemoryOperandIsWritten(ins, memOp))
+    {
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)LineWriteMiss, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, tls_reg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_ADDRINT, (ADDRINT)size,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RecordLineWrite, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, size,
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, slot,
+            IARG_END);
+    }
 }
 
 // Is called for every instruction and instruments reads and writes
 VOID Instruction(INS ins, VOID *v)
 {
-    // Instruments memory accesses using a predicated call, i.e.
-    // the instrumentation is called iff the instruction will actually be executed.
-    //
-    // On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
-    // prefixed instructions appear as predicated instructions in Pin.
     UINT32 memOperands = INS_MemoryOperandCount(ins);
+    UINT32 window = roi.Window();
+    UINT32 slot = (slotted && memOperands) ? SlotOf(ins) : 0;
 
     // Iterate over each memory operand of the instruction.
     for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        InstrumentOperand(ins, memOp, window, slot);
+}
+
+// Instruments the memory operands of a basic block, one call per
+// coalesced run
+VOID InstrumentBbl(BBL bbl)
+{
+    UINT32 window = roi.Window();
+    vector<COALESCE_RUN> runs;
+    coalescer.Bbl(bbl, COALESCE_READS | COALESCE_WRITES, runs);
+    for (UINT32 r = 0; r < runs.size(); r++)
+    {
+        const vector<COALESCE_OPERAND> & ops = runs[r].operands;
+        if (ops.size() == 1)
+        {
+            InstrumentOperand(ops[0].ins, ops[0].memOp, window,
+                              slotted ? SlotOf(ops[0].ins) : 0);
+            continue;
+        }
+
+        COALESCE_ACCESS * run = coalescer.Describe(runs[r], COALESCE_READS | COALESCE_WRITES);
+        for (UINT32 i = 0; slotted && i < ops.size(); i++)
+            run[i].slot = SlotOf(ops[i].ins);
+        for (UINT32 i = 0; patterns && i < ops.size(); i++)
+            run[i].operand = strides.Operand(run[i].slot, ops[i].memOp);
+        INS_InsertCall(
+            ops[0].ins, IPOINT_BEFORE, (AFUNPTR)RecordRun, IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, ops[0].memOp,
+            IARG_PTR, run,
+            IARG_UINT32, (UINT32)ops.size(),
+            IARG_REG_VALUE, tls_reg,
+            IARG_UINT32, window,
+            IARG_END);
+    }
+}
+
+// Instruments the memory accesses of a trace, if it runs inside a region
+// of interest window, and only in the bursts when sampling
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (!roi.InstrumentTrace(trace) || !sampler.InstrumentTrace(trace))
+        return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (coalescer.Enabled())
+            InstrumentBbl(bbl);
+        else
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                Instruction(ins, v);
+    }
+}
+
+// The sharing file of a window: memfootprint_sharing.csv becomes
+// memfootprint_sharing_w<window>.csv
+static string WindowFileName(const string & name, UINT32 window)
+{
+    if (!roi.Enabled())
+        return name;
+    string::size_type dot = name.rfind('.');
+    if (dot == string::npos || name.find('/', dot) != string::npos)
+        dot = name.size();
+    return name.substr(0, dot) + "_w" + decstr(window) + name.substr(dot);
+}
+
+// Totals of a slot, routine or image over all threads
+struct HOTSPOT
+{
+    UINT32 id;
+    UINT64 reads;
+    UINT64 writes;
+    UINT64 bytes;
+    UINT64 lines;
+};
+
+static bool MoreAccesses(const HOTSPOT & a, const HOTSPOT & b)
+{
+    return a.reads + a.writes > b.reads + b.writes;
+}
+
+// Adds the lines of every (slot, line) key to its slot, routine and image
+struct COUNT_HOTSPOT_LINES
+{
+    vector<HOTSPOT> * bySlot;
+    DIRTY_SET rtnLines;
+    DIRTY_SET imgLines;
+
+    VOID operator()(UINT64 key, UINT64 bits)
+    {
+        UINT32 slot = key >> HOTSPOT_SLOT_SHIFT;
+        UINT64 group = key & ((1ULL << HOTSPOT_SLOT_SHIFT) - 1);
+        UINT32 rtn = slots[slot].rtn;
+        (*bySlot)[slot].lines += __builtin_popcountll(bits);
+        rtnLines.Insert((UINT64)rtn << HOTSPOT_SLOT_SHIFT | group, bits);
+        imgLines.Insert((UINT64)routines[rtn].img << HOTSPOT_SLOT_SHIFT | group, bits);
+    }
+};
+
+// Spreads the lines of (id, line) keys over their ids
+struct COUNT_ID_LINES
+{
+    vector<HOTSPOT> * byId;
+
+    VOID operator()(UINT64 key, UINT64 bits)
+    {
+        (*byId)[key >> HOTSPOT_SLOT_SHIFT].lines += __builtin_popcountll(bits);
+    }
+};
+
+enum HOTSPOT_KIND
+{
+    HOTSPOT_SLOT,
+    HOTSPOT_ROUTINE,
+    HOTSPOT_IMAGE
+};
+
+// Prints the n entries of h with the most accesses
+static VOID PrintHotspots(const char * title, vector<HOTSPOT> & h, UINT32 n, HOTSPOT_KIND kind)
+{
+    sort(h.begin(), h.end(), MoreAccesses);
+    printf("%s\n", title);
+    printf("%-18s %14s %14s %12s %7s  %s\n", kind == HOTSPOT_SLOT ? "ip" : "rank",
+           "accesses", "bytes", "lines", "reads", kind == HOTSPOT_IMAGE ? "image" : "routine image");
+    for (UINT32 i = 0; i < h.size() && i < n; i++)
     {
-        const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+        UINT64 accesses = h[i].reads + h[i].writes;
+        if (accesses == 0)
+            break;
+
+        string where;
+        if (kind == HOTSPOT_SLOT)
+        {
+            const ROUTINE & rtn = routines[slots[h[i].id].rtn];
+            printf("0x%-16lx", (unsigned long)slots[h[i].id].ip);
+            where = rtn.name + " " + StripPath(images[rtn.img].c_str());
+        }
+        else if (kind == HOTSPOT_ROUTINE)
+        {
+            const ROUTINE & rtn = routines[h[i].id];
+            printf("%-18u", i + 1);
+            where = rtn.name + " " + StripPath(images[rtn.img].c_str());
+        }
+        else
+        {
+            printf("%-18u", i + 1);
+            where = images[h[i].id];
+        }
+        printf(" %14lu %14lu %12lu %6.1f%%  %s\n", accesses, h[i].bytes, h[i].lines,
+               100.0 * h[i].reads / accesses, where.c_str());
+    }
+}
 
-        if (INS_MemoryOperandIsRead(ins, memOp))
+// Prints the top instructions and routines by accesses, and every image
+static VOID ReportHotspots()
+{
+    HOTSPOT zero = { 0, 0, 0, 0, 0 };
+    vector<HOTSPOT> bySlot(slots.size(), zero);
+    vector<HOTSPOT> byRtn(routines.size(), zero);
+    vector<HOTSPOT> byImg(images.size(), zero);
+    for (UINT32 s = 0; s < slots.size(); s++)
+        bySlot[s].id = s;
+    for (UINT32 r = 0; r < routines.size(); r++)
+        byRtn[r].id = r;
+    for (UINT32 m = 0; m < images.size(); m++)
+        byImg[m].id = m;
+
+    // Unique lines are counted over the union of the threads' sets
+    DIRTY_SET lines;
+    for (UINT32 i = 0; i < threads.size(); i++)
+    {
+        THREAD_DATA * td = threads[i];
+        for (UINT32 s = 0; s < td->slots.size() && s < slots.size(); s++)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_UINT32, size, 
-                IARG_THREAD_ID, 
-                IARG_END);
+            const SLOT_COUNTS & c = td->slots[s];
+            bySlot[s].reads += c.reads;
+            bySlot[s].writes += c.writes;
+            bySlot[s].bytes += c.bytes;
         }
-        // Note that in some architectures a single memory operand can be 
-        // both read and written (for instance incl (%eax) on IA-32)
-        // In that case we instrument it once for read and once for write.
-        if (INS_MemoryOperandIsWritten(ins, memOp))
+        lines.InsertAll(td->lines);
+    }
+    COUNT_HOTSPOT_LINES counter;
+    counter.bySlot = &bySlot;
+    lines.ForEach(counter);
+
+    for (UINT32 s = 0; s < slots.size(); s++)
+    {
+        HOTSPOT & r = byRtn[slots[s].rtn];
+        HOTSPOT & m = byImg[routines[slots[s].rtn].img];
+        r.reads += bySlot[s].reads;
+        r.writes += bySlot[s].writes;
+        r.bytes += bySlot[s].bytes;
+        m.reads += bySlot[s].reads;
+        m.writes += bySlot[s].writes;
+        m.bytes += bySlot[s].bytes;
+    }
+    COUNT_ID_LINES rtnCounter;
+    rtnCounter.byId = &byRtn;
+    counter.rtnLines.ForEach(rtnCounter);
+    COUNT_ID_LINES imgCounter;
+    imgCounter.byId = &byImg;
+    counter.imgLines.ForEach(imgCounter);
+
+    UINT32 n = KnobHotspots.Value();
+    PrintHotspots("Hot instructions", bySlot, n, HOTSPOT_SLOT);
+    PrintHotspots("Hot routines", byRtn, n, HOTSPOT_ROUTINE);
+    PrintHotspots("Images", byImg, images.size(), HOTSPOT_IMAGE);
+}
+
+// Prints the falsely shared lines with the most invalidations, with the
+// bytes each thread wrote and the first instruction that wrote them
+static VOID ReportFalseSharing()
+{
+    UINT64 shared, trueShared;
+    vector<const FS_LINE *> ranked;
+    lineWriters.Collect(KnobFalseSharingTop.Value(), &shared, &trueShared, ranked);
+    printf("Write-shared lines %lu\n", shared);
+    printf("Falsely shared lines %lu\n", shared - trueShared);
+    for (UINT32 i = 0; i < ranked.size(); i++)
+    {
+        const FS_LINE * r = ranked[i];
+        printf("0x%lx invalidations %lu\n", (unsigned long)(r->line << FS_LINE_SHIFT),
+               r->invalidations);
+        for (UINT32 w = 0; w < FS_WRITERS && r->writer[w].id; w++)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_UINT32, size, 
-                IARG_THREAD_ID,
-                IARG_END);
+            const FS_WRITER & fw = r->writer[w];
+            const ROUTINE & rtn = routines[slots[fw.slot].rtn];
+            string where = rtn.name + " " + StripPath(images[rtn.img].c_str());
+            printf("  thread %u bytes %s writes %lu ip 0x%lx %s\n",
+                   threads[fw.id - 1]->tid, FS_ByteRanges(fw.bytes).c_str(), fw.writes,
+                   (unsigned long)slots[fw.slot].ip, where.c_str());
         }
+        if (r->extraWrites)
+            printf("  other threads bytes %s writes %lu\n",
+                   FS_ByteRanges(r->extraBytes).c_str(), r->extraWrites);
+    }
+}
+
+// Prints the accesses of each access pattern, and the busiest operands
+// with their pattern, dominant stride, the share of the strides that
+// were the dominant one and the share of the accesses a stride
+// prefetcher would have covered
+static VOID ReportStrides()
+{
+    vector<const vector<STRIDE_STATE> *> states;
+    for (UINT32 i = 0; i < threads.size(); i++)
+        states.push_back(&threads[i]->strides);
+    vector<STRIDE_SUMMARY> sums;
+    strides.Finish(states, sums);
+
+    UINT64 operands[STRIDE_CLASSES] = { 0 };
+    UINT64 accesses[STRIDE_CLASSES] = { 0 };
+    for (UINT32 i = 0; i < sums.size(); i++)
+    {
+        operands[sums[i].cls]++;
+        accesses[sums[i].cls] += sums[i].accesses;
+    }
+    printf("Access patterns\n");
+    for (UINT32 c = 0; c < STRIDE_CLASSES; c++)
+        printf("%-16s operands %8lu accesses %14lu\n", STRIDE_ClassNames[c], operands[c], accesses[c]);
+
+    printf("%-18s %14s %-16s %12s %7s %7s  %s\n", "ip", "accesses", "pattern", "stride",
+           "share", "covered", "routine image");
+    for (UINT32 i = 0; i < sums.size() && i < KnobStrides.Value(); i++)
+    {
+        const STRIDE_SUMMARY & s = sums[i];
+        const SLOT_INFO & info = slots[strides.Slot(s.operand)];
+        const ROUTINE & rtn = routines[info.rtn];
+        string where = rtn.name + " " + StripPath(images[rtn.img].c_str());
+        printf("0x%-16lx %14lu %-16s %12ld %6.1f%% %6.1f%%  %s\n", (unsigned long)info.ip,
+               s.accesses, STRIDE_ClassNames[s.cls], (long)s.dominant,
+               100.0 * s.dominantCount / s.strides, 100.0 * s.predicted / s.accesses,
+               where.c_str());
+    }
+}
+
+// Prints the reuse distance histograms and miss ratio curves, the whole
+// process first and then every thread
+static VOID PrintReuse()
+{
+    vector<const REUSE_HISTOGRAM *> h;
+    h.push_back(&globalReuse->Histogram());
+    for (UINT32 i = 0; i < threads.size(); i++)
+        h.push_back(&threads[i]->reuse->Histogram());
+
+    UINT32 maxBucket = 0;
+    for (UINT32 c = 0; c < h.size(); c++)
+        for (UINT32 b = 0; b < REUSE_BUCKETS; b++)
+            if (h[c]->buckets[b] && b > maxBucket)
+                maxBucket = b;
+
+    UINT64 granularity = 1ULL << reuseShift;
+    printf("Reuse distance in %lu-byte lines, sampling rate %g\n",
+           granularity, KnobReuseRate.Value());
+    printf("%-12s %12s", "distance", "all");
+    for (UINT32 i = 0; i < threads.size(); i++)
+        printf(" %12u", threads[i]->tid);
+    printf("\n");
+    for (UINT32 b = 0; b <= maxBucket; b++)
+    {
+        string range = b < 2 ? decstr(b) : decstr(1ULL << (b - 1)) + "-" + decstr((1ULL << b) - 1);
+        printf("%-12s", range.c_str());
+        for (UINT32 c = 0; c < h.size(); c++)
+            printf(" %12lu", h[c]->buckets[b]);
+        printf("\n");
+    }
+    printf("%-12s", "cold");
+    for (UINT32 c = 0; c < h.size(); c++)
+        printf(" %12lu", h[c]->cold);
+    printf("\n");
+
+    printf("Miss ratio by LRU cache size\n");
+    printf("%-12s %12s", "bytes", "all");
+    for (UINT32 i = 0; i < threads.size(); i++)
+        printf(" %12u", threads[i]->tid);
+    printf("\n");
+    for (UINT32 b = 0; b <= maxBucket; b++)
+    {
+        printf("%-12lu", granularity << b);
+        for (UINT32 c = 0; c < h.size(); c++)
+            printf(" %12.4f", h[c]->refs ? (double)h[c]->Misses(b) / h[c]->refs : 0.0);
+        printf("\n");
     }
 }
 
@@ -152,40 +1354,95 @@ VOID Fini(INT32 code, VOID *v)
 {
     printf("Number of threads ever exist = %d\n", numThreads); 
 
+    // Windows opened; always just window 0 without a region of interest
+    UINT32 numWindows = roi.NumWindows();
 
-    //fprintf(trace, "#eof\n");
-    //fclose(trace);
-    
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
+    for (UINT32 i = 0; i < threads.size(); i++)
     {
-        //fprintf(trace_files[t], "#eof\n");
-        fclose(trace_files[t]);
+        THREAD_DATA * td = threads[i];
+        FlushFilter(td, &td->read_filter);
+        FlushFilter(td, &td->write_filter);
+        FlushLineHits(td);
     }
 
-
-    UINT64 total_all_bytes_read = 0;
-    UINT64 total_addrs = 0;
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
+    // Threads still running publish what they have
+    for (UINT32 i = 0; i < threads.size(); i++)
     {
-        printf("Thread %d addrs %lu all_bytes_read %lu\n", t, addrs[t].size(), thread_all_bytes_read[t]);
-        total_addrs += addrs[t].size();
-        total_all_bytes_read += thread_all_bytes_read[t];
+        if (threads[i]->stats && threads[i]->current)
+        {
+            threads[i]->stats_countdown = 1;
+            PublishStats(threads[i], threads[i]->current);
+        }
     }
 
-    UINT32 num_read_only_addrs = 0;
-    map <ADDRINT, ADDRSTAT>::iterator itr = addrs[0].begin();
-    while (itr != addrs[0].end())
+    // Without PrepareForFini the workers are gone, and Fini merges alone
+    if (!merged)
+        MergeTables(numWindows, FALSE);
+    numWindows = mergeOutputs.back()->results.size();
+
+    UINT64 unique_addrs = 0;
+    for (UINT32 w = 0; w < numWindows; w++)
     {
-        if ((itr->second).is_read && !(itr->second).is_write)
-            num_read_only_addrs++;
-        itr++;
+        FOOTPRINT_COUNTS total;
+        vector<UINT64> sharing;
+        if (mergeSharing)
+            sharing.assign((size_t)mergeThreads * mergeThreads, 0);
+        for (UINT32 o = 0; o < mergeOutputs.size(); o++)
+        {
+            const MERGE_RESULT * r = mergeOutputs[o]->results[w];
+            total.Add(*r);
+            r->groups.AddSharing(sharing, mergeThreads);
+        }
+
+        if (roi.Enabled())
+            printf("Window %u\n", w);
+
+        UINT64 total_all_bytes_read = 0;
+        UINT64 total_addrs = 0;
+        for (UINT32 i = 0; i < threads.size(); i++)
+        {
+            THREAD_DATA * td = threads[i];
+            WINDOW_DATA * wd = w < td->windows.size() ? td->windows[w] : NULL;
+            UINT64 num_addrs = wd ? wd->addrs.Size() : 0;
+            UINT64 all_bytes_read = wd ? wd->all_bytes_read : 0;
+            printf("Thread %u addrs %lu all_bytes_read %lu\n", td->tid, num_addrs, all_bytes_read);
+            total_addrs += num_addrs;
+            total_all_bytes_read += all_bytes_read;
+        }
+
+        printf("Total addrs %lu\n", total_addrs);
+        total.Print(stdout);
+        unique_addrs += total.unique_addrs;
+        printf("Total all_bytes_read %lu\n", total_all_bytes_read);
+
+        if (mergeSharing)
+            WriteSharing(WindowFileName(KnobSharingFile.Value(), w).c_str(), sharing);
     }
 
-    printf("Total addrs %lu\n", total_addrs);
-    printf("Read-only addrs %u\n", num_read_only_addrs);
-    printf("Total all_bytes_read %lu\n", total_all_bytes_read);
+    if (KnobReuse)
+    {
+        for (UINT32 i = 0; i < threads.size(); i++)
+            FlushReuse(threads[i]);
+        PrintReuse();
+    }
+    if (hotspots)
+        ReportHotspots();
+    if (falseSharing)
+        ReportFalseSharing();
+    if (patterns)
+        ReportStrides();
+    sampler.Report(stdout, "");
+    coalescer.Report(stdout);
+    selfprof.Report(stdout);
 
-    free(trace_files);
+    // Summed over the windows
+    if (statseg.Enabled())
+    {
+        statseg.BeginGlobal();
+        statseg.SetGlobal(STATSEG_TOTAL_UNIQUE_ADDRS, unique_addrs);
+        statseg.EndGlobal();
+    }
+    statseg.Finish();
 }
 
 /* ===================================================================== */
@@ -208,19 +1465,79 @@ int main(int argc, char *argv[])
     // Initialize pin
     if (PIN_Init(argc, argv)) return Usage();
 
-    //trace = fopen("pinatrace.out", "w");
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
+    tls_key = PIN_CreateThreadDataKey(0);
+    tls_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(tls_reg))
     {
-        char buffer[25];
-        snprintf(buffer, sizeof(char) * 20, "memfootprint_%d.out", t);
-        trace_files[t] = fopen(buffer, "w");
+        fprintf(stderr, "Error: cannot allocate a scratch register\n");
+        return 1;
+    }
+    if (!roi.Init(0))
+        return 1;
+
+    UINT64 g = KnobReuseGranularity.Value();
+    double rate = KnobReuseRate.Value();
+    if (g == 0 || (g & (g - 1)) != 0)
+    {
+        fprintf(stderr, "Error: reuse granularity %lu is not a power of two\n", g);
+        return 1;
+    }
+    if (!(rate > 0 && rate <= 1))
+    {
+        fprintf(stderr, "Error: reuse rate must be in (0, 1]\n");
+        return 1;
+    }
+    hotspots = KnobHotspots.Value() != 0;
+    filter = KnobFilter.Value();
+    reuseAll = KnobReuse && rate >= 1;
+    reuseSampled = KnobReuse && rate < 1;
+    falseSharing = lineWriters.Enabled();
+    patterns = strides.Enabled();
+    slotted = hotspots || falseSharing || patterns;
+    if (slotted)
+        PIN_InitSymbols();
+    reuseShift = __builtin_ctzll(g);
+    reuseThreshold = (UINT64)(rate * (1 << 24));
+    if (KnobReuse)
+        globalReuse = new REUSE_STACK(1 / rate);
+
+    if (!sampler.Init())
+    {
+        fprintf(stderr, "Error: cannot allocate the sampling registers\n");
+        return 1;
     }
 
     PIN_InitLock(&lock);
     PIN_InitLock(&bytes_lock);
+    PIN_InitLock(&reuse_lock);
+    PIN_SemaphoreInit(&mergeStart);
+    if (!selfprof.Start(NULL, NULL))
+        return 1;
+    if (!statseg.Start("memfootprint_mt", 1 << STATSEG_BYTES | 1 << STATSEG_UNIQUE_ADDRS,
+                       1 << STATSEG_TOTAL_UNIQUE_ADDRS))
+        return 1;
+
+    // One output per merge worker, plus one for the exiting thread.  A
+    // worker that cannot be spawned simply leaves its share to the others.
+    for (UINT32 w = 0; w < KnobMergeThreads.Value(); w++)
+    {
+        MERGE_OUTPUT * out = new MERGE_OUTPUT;
+        PIN_THREAD_UID uid;
+        if (PIN_SpawnInternalThread(MergeWorker, out, 0, &uid) == INVALID_THREADID)
+        {
+            delete out;
+            break;
+        }
+        mergeOutputs.push_back(out);
+        mergeUids.push_back(uid);
+    }
+    mergeOutputs.push_back(new MERGE_OUTPUT);
+
     PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
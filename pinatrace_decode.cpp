@@ -0,0 +1,121 @@
+/*
+ *  Native (non-Pin) decoder for the binary traces written by pinatrace_mt.
+ *  Streams a raw or compressed pinatrace_<tid>.out file back out in the
+ *  text format, one block at a time:
+ *
+ *      pinatrace_decode [-index] [-blocks first[:count]] pinatrace_0.out [pinatrace_0.txt]
+ *
+ *  -index prints the block table instead of the records, and -blocks
+ *  decodes only a range of blocks, so several decoders can work on
+ *  different parts of one file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pinatrace_reader.H"
+
+static void Usage(const char * prog)
+{
+    fprintf(stderr, "usage: %s [-index] [-blocks first[:count]] <binary trace> [<text output>]\n",
+            prog);
+}
+
+static void PrintRecord(FILE * out, const PINATRACE_RECORD64 & rec)
+{
+    if (rec.flags & PINATRACE_FLAG_EOF)
+        fprintf(out, "#eof\n");
+    else
+        fprintf(out, "%p: %c %p\n", (void *)(uintptr_t)rec.ip,
+                (rec.flags & PINATRACE_FLAG_WRITE) ? 'W' : 'R', (void *)(uintptr_t)rec.ea);
+}
+
+static void PrintIndex(FILE * out, const PINATRACE_READER & reader)
+{
+    fprintf(out, "# encoding %s, addr_size %u, %llu records in %llu blocks\n",
+            reader.Header().encoding == PINATRACE_ENCODING_COMPRESSED ? "compressed" : "raw",
+            reader.Header().addr_size, (unsigned long long)reader.NumRecords(),
+            (unsigned long long)reader.NumBlocks());
+    fprintf(out, "# block offset first_record\n");
+    for (uint64_t b = 0; b < reader.NumBlocks(); b++)
+        fprintf(out, "%llu %llu %llu\n", (unsigned long long)b,
+                (unsigned long long)reader.BlockOffset(b),
+                (unsigned long long)reader.BlockFirstRecord(b));
+}
+
+int main(int argc, char *argv[])
+{
+    bool index = false;
+    unsigned long long firstBlock = 0;
+    unsigned long long numBlocks = ~0ULL;
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "-index") == 0)
+            index = true;
+        else if (strcmp(argv[arg], "-blocks") == 0 && arg + 1 < argc)
+        {
+            char * end;
+            firstBlock = strtoull(argv[++arg], &end, 0);
+            if (*end == ':')
+                numBlocks = strtoull(end + 1, &end, 0);
+            if (*end != '\0')
+            {
+                Usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - arg < 1 || argc - arg > 2)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    PINATRACE_READER reader;
+    if (!reader.Open(argv[arg]))
+    {
+        fprintf(stderr, "%s\n", reader.Error().c_str());
+        return 1;
+    }
+
+    FILE * out = stdout;
+    if (argc - arg == 2 && !(out = fopen(argv[arg + 1], "w")))
+    {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+
+    int ret = 0;
+    if (index)
+        PrintIndex(out, reader);
+    else
+    {
+        uint64_t lastBlock = reader.NumBlocks();
+        if (firstBlock < lastBlock && numBlocks < lastBlock - firstBlock)
+            lastBlock = firstBlock + numBlocks;
+
+        std::vector<PINATRACE_RECORD64> recs;
+        for (uint64_t b = firstBlock; b < lastBlock; b++)
+        {
+            if (!reader.ReadBlock(b, recs))
+            {
+                fprintf(stderr, "%s: corrupt block %llu\n", argv[arg], (unsigned long long)b);
+                ret = 1;
+                break;
+            }
+            for (size_t i = 0; i < recs.size(); i++)
+                PrintRecord(out, recs[i]);
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+    return ret;
+}
@@ -34,59 +34,151 @@ END_LEGAL */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <set>
 #include "pin.H"
+#include "pinatrace_format.H"
+#include "sampling.H"
+#include "roi.H"
+#include "async_writer.H"
+#include "trace_file.H"
+#include "cachesim_stage.H"
+#include "selfprof.H"
+#include "statseg.H"
 
-#define MAX_NUM_THREADS 8
+KNOB<string> KnobFormat(KNOB_MODE_WRITEONCE, "pintool",
+        "format", "binary", "trace file format: text, binary, compressed or none");
+KNOB<UINT32> KnobNumPagesInBuffer(KNOB_MODE_WRITEONCE, "pintool",
+        "num_pages_in_buffer", "256", "number of pages in each per-thread trace buffer");
 
 PIN_LOCK lock;
+SAMPLER sampler;
+ROI roi;
+ASYNC_WRITER writer;
+TRACE_FILES traceFiles(writer);
+CACHESIM_STAGE cachesim;
+SELFPROF selfprof;
+STATSEG statseg;
 
 INT32 numThreads = 0;
 
-//FILE * trace;
-FILE** trace_files = (FILE **)malloc(sizeof(FILE*) * (MAX_NUM_THREADS));
+TRACE_FORMAT format = FORMAT_BINARY;
 
-// Print a memory read record
-VOID RecordMemRead(VOID * ip, VOID * addr, THREADID threadid)
+// Memory references are collected in a per-thread Pin trace buffer of
+// MEMREFs and written out a whole buffer at a time
+BUFFER_ID bufId;
+
+// Per-thread state, created when the thread starts and reached through Pin TLS
+struct THREAD_DATA
 {
-    fprintf(trace_files[threadid],"%p: R %p\n", ip, addr);
+    THREAD_TRACE trace;
+    CACHESIM_PRODUCER sim;      // -cachesim only
+    SELFPROF_THREAD * prof;     // NULL without -selfprof
+    STATSEG_THREAD * stats;     // NULL without -statseg
+    UINT64 accesses;            // -statseg only
+    UINT64 bytes;
+};
+
+TLS_KEY tls_key;
+
+// Threads whose trace files still have to be closed
+set<THREAD_DATA *> liveThreads;
+
+// Called by Pin when a thread's trace buffer fills up, and when the thread exits
+VOID * BufferFull(BUFFER_ID id, THREADID threadid, const CONTEXT *ctxt, VOID *buf,
+                  UINT64 numElements, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+    if (numElements == 0)
+        return buf;
+
+    SELFPROF_TIMER timer(td->prof);
+    const MEMREF * ref = (const MEMREF *)buf;
+    if (td->stats)
+    {
+        for (UINT64 i = 0; i < numElements; i++)
+            td->bytes += ref[i].size;
+        td->accesses += numElements;
+        STATSEG_WriteBegin(&td->stats->seq);
+        td->stats->counters[STATSEG_ACCESSES] = td->accesses;
+        td->stats->counters[STATSEG_BYTES] = td->bytes;
+        STATSEG_WriteEnd(&td->stats->seq);
+    }
+    if (cachesim.Enabled())
+        cachesim.Submit(&td->sim, ref, numElements);
+    traceFiles.Write(&td->trace, ref, numElements, td->prof);
+    return buf;
 }
 
-// Print a memory write record
-VOID RecordMemWrite(VOID * ip, VOID * addr, THREADID threadid)
+// Closes the thread's trace file, if it ever wrote one, and frees its state
+VOID FinishThread(THREAD_DATA * td)
 {
-    fprintf(trace_files[threadid],"%p: W %p\n", ip, addr);
+    traceFiles.Close(&td->trace);
+    delete td;
 }
 
 VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    PIN_InitLock(&lock);
-    PIN_GetLock(&lock, threadid+1);
+    THREAD_DATA * td = new THREAD_DATA;
+    td->prof = selfprof.ThreadStart(threadid);
+    td->stats = statseg.ThreadStart(threadid);
+    td->accesses = 0;
+    td->bytes = 0;
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
     numThreads++;
+    liveThreads.insert(td);
     PIN_ReleaseLock(&lock);
+    traceFiles.ThreadStart(&td->trace, threadid, td->prof);
 
-    ASSERT(numThreads <= MAX_NUM_THREADS, "Maximum number of threads exceeded\n");
+    if (cachesim.Enabled())
+        cachesim.ThreadStart(&td->sim, threadid);
+    PIN_SetThreadData(tls_key, td, threadid);
+    roi.ThreadStart(threadid, ctxt);
+    sampler.ThreadStart(threadid, ctxt);
+}
+
+// Pin flushes the thread's trace buffer before calling this
+VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA * td = static_cast<THREAD_DATA *>(PIN_GetThreadData(tls_key, threadid));
+
+    SELFPROF_GetLock(td->prof, &lock, threadid+1);
+    liveThreads.erase(td);
+    PIN_ReleaseLock(&lock);
+
+    statseg.ThreadFini(td->stats);
+    FinishThread(td);
+    PIN_SetThreadData(tls_key, 0, threadid);
+    sampler.ThreadFini(threadid, ctxt);
 }
 
 // Is called for every instruction and instruments reads and writes
 VOID Instruction(INS ins, VOID *v)
 {
-    // Instruments memory accesses using a predicated call, i.e.
-    // the instrumentation is called iff the instruction will actually be executed.
+    // Instruments memory accesses using a predicated fill, i.e.
+    // the record is written iff the instruction will actually be executed.
     //
     // On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
     // prefixed instructions appear as predicated instructions in Pin.
     UINT32 memOperands = INS_MemoryOperandCount(ins);
+    UINT32 window = roi.Window() << PINATRACE_FLAG_WINDOW_SHIFT;
 
     // Iterate over each memory operand of the instruction.
     for (UINT32 memOp = 0; memOp < memOperands; memOp++)
     {
+        const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
         if (INS_MemoryOperandIsRead(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_THREAD_ID, 
+            INS_InsertFillBufferPredicated(
+                ins, IPOINT_BEFORE, bufId,
+                IARG_INST_PTR, offsetof(MEMREF, ip),
+                IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, ea),
+                IARG_UINT32, size, offsetof(MEMREF, size),
+                IARG_UINT32, window, offsetof(MEMREF, flags),
                 IARG_END);
         }
         // Note that in some architectures a single memory operand can be 
@@ -94,16 +186,29 @@ VOID Instruction(INS ins, VOID *v)
         // In that case we instrument it once for read and once for write.
         if (INS_MemoryOperandIsWritten(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_THREAD_ID,
+            INS_InsertFillBufferPredicated(
+                ins, IPOINT_BEFORE, bufId,
+                IARG_INST_PTR, offsetof(MEMREF, ip),
+                IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, ea),
+                IARG_UINT32, size, offsetof(MEMREF, size),
+                IARG_UINT32, window | PINATRACE_FLAG_WRITE, offsetof(MEMREF, flags),
                 IARG_END);
         }
     }
 }
 
+// Instruments the memory accesses of a trace, if it runs inside a region
+// of interest window, and only in the bursts when sampling
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (!roi.InstrumentTrace(trace) || !sampler.InstrumentTrace(trace))
+        return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            Instruction(ins, v);
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
     printf("Number of threads ever exist = %d\n", numThreads); 
@@ -112,13 +217,17 @@ VOID Fini(INT32 code, VOID *v)
     //fprintf(trace, "#eof\n");
     //fclose(trace);
     
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
-    {
-        fprintf(trace_files[t], "#eof\n");
-        fclose(trace_files[t]);
-    }
+    // Threads that were still running when the application exited
+    for (set<THREAD_DATA *>::iterator it = liveThreads.begin(); it != liveThreads.end(); it++)
+        FinishThread(*it);
+    liveThreads.clear();
+    writer.Finish();
+    cachesim.Finish();
 
-    free(trace_files);
+    sampler.Report(stdout, "");
+    cachesim.Report(stdout);
+    selfprof.Report(stdout);
+    statseg.Finish();
 }
 
 /* ===================================================================== */
@@ -141,18 +250,39 @@ int main(int argc, char *argv[])
     // Initialize pin
     if (PIN_Init(argc, argv)) return Usage();
 
-    //trace = fopen("pinatrace.out", "w");
-    for (INT32 t=0; t<MAX_NUM_THREADS; t++)
+    if (!TRACE_ParseFormat(KnobFormat.Value(), &format))
+        return Usage();
+
+    bufId = PIN_DefineTraceBuffer(sizeof(MEMREF), KnobNumPagesInBuffer.Value(),
+                                  BufferFull, 0);
+    if (bufId == BUFFER_ID_INVALID)
+    {
+        fprintf(stderr, "Error: could not allocate initial trace buffer\n");
+        return 1;
+    }
+
+    tls_key = PIN_CreateThreadDataKey(0);
+    if (!roi.Init(0))
+        return 1;
+    traceFiles.Start(format, roi.Enabled());
+    if (!sampler.Init())
     {
-        char buffer[20];
-        snprintf(buffer, sizeof(char) * 20, "pinatrace_%d.out", t);
-        trace_files[t] = fopen(buffer, "w");
+        fprintf(stderr, "Error: cannot allocate the sampling registers\n");
+        return 1;
     }
 
     PIN_InitLock(&lock);
+    writer.Start();
+    if (!cachesim.Start())
+        return 1;
+    if (!selfprof.Start(ASYNC_WRITER::PrintStats, &writer))
+        return 1;
+    if (!statseg.Start("pinatrace_mt", 1 << STATSEG_ACCESSES | 1 << STATSEG_BYTES, 0))
+        return 1;
     PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
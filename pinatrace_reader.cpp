@@ -0,0 +1,285 @@
+/*
+ *  Native reader library for the binary traces written by pinatrace_mt.
+ *  See pinatrace_reader.H.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pinatrace_reader.H"
+#include "pinatrace_codec.H"
+
+PINATRACE_READER::PINATRACE_READER()
+  : _fd(-1), _map(NULL), _mapSize(0), _numRecords(0), _nextBlock(0), _pos(0)
+{
+    memset(&_header, 0, sizeof(_header));
+}
+
+PINATRACE_READER::~PINATRACE_READER()
+{
+    Close();
+}
+
+void PINATRACE_READER::Close()
+{
+    if (_map)
+        munmap((void *)_map, _mapSize);
+    _map = NULL;
+    _mapSize = 0;
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+    _blocks.clear();
+    _current.clear();
+    _numRecords = 0;
+    _nextBlock = 0;
+    _pos = 0;
+}
+
+bool PINATRACE_READER::ReadAt(uint64_t offset, void * buf, uint64_t size) const
+{
+    if (_map)
+    {
+        if (offset > _mapSize || size > _mapSize - offset)
+            return false;
+        memcpy(buf, _map + offset, size);
+        return true;
+    }
+
+    char * p = (char *)buf;
+    while (size > 0)
+    {
+        ssize_t n = pread(_fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool PINATRACE_READER::Open(const char * path)
+{
+    Close();
+    _path = path;
+
+    if ((_fd = open(path, O_RDONLY)) < 0)
+    {
+        _error = _path + ": " + strerror(errno);
+        return false;
+    }
+
+    // Fall back to reading if the file cannot be mapped
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && st.st_size > 0)
+    {
+        void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (map != MAP_FAILED)
+        {
+            _map = (const char *)map;
+            _mapSize = st.st_size;
+        }
+    }
+
+    if (fstat(_fd, &st) != 0 || !ReadAt(0, &_header, sizeof(_header)) ||
+        memcmp(_header.magic, PINATRACE_MAGIC, sizeof(PINATRACE_MAGIC)) != 0)
+    {
+        _error = _path + ": not a binary pinatrace file";
+        Close();
+        return false;
+    }
+    if (_header.version != PINATRACE_VERSION)
+    {
+        _error = _path + ": unsupported trace version";
+        Close();
+        return false;
+    }
+    if (!((_header.addr_size == 8 && _header.record_size == sizeof(PINATRACE_RECORD64)) ||
+          (_header.addr_size == 4 && _header.record_size == sizeof(PINATRACE_RECORD32))))
+    {
+        _error = _path + ": unsupported record layout";
+        Close();
+        return false;
+    }
+
+    uint64_t fileSize = st.st_size;
+
+    if (_header.encoding == PINATRACE_ENCODING_RAW)
+    {
+        _numRecords = (fileSize - sizeof(_header)) / _header.record_size;
+        for (uint64_t r = 0; r < _numRecords; r += PINATRACE_RAW_BLOCK_RECORDS)
+        {
+            PINATRACE_INDEX_ENTRY e;
+            e.offset = sizeof(_header) + r * _header.record_size;
+            e.first_record = r;
+            _blocks.push_back(e);
+        }
+    }
+    else if (_header.encoding == PINATRACE_ENCODING_COMPRESSED)
+    {
+        // Files that were not closed cleanly have no index
+        if (!ReadIndex(fileSize))
+            ScanBlocks(fileSize);
+    }
+    else
+    {
+        _error = _path + ": unknown trace encoding";
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+bool PINATRACE_READER::ReadIndex(uint64_t fileSize)
+{
+    PINATRACE_TRAILER trailer;
+    if (fileSize < sizeof(_header) + sizeof(trailer) ||
+        !ReadAt(fileSize - sizeof(trailer), &trailer, sizeof(trailer)) ||
+        memcmp(trailer.magic, PINATRACE_TRAILER_MAGIC, sizeof(PINATRACE_TRAILER_MAGIC)) != 0 ||
+        trailer.index_offset + trailer.num_blocks * sizeof(PINATRACE_INDEX_ENTRY) + sizeof(trailer)
+            != fileSize)
+    {
+        return false;
+    }
+
+    _blocks.resize(trailer.num_blocks);
+    if (trailer.num_blocks == 0)
+        return true;
+    if (!ReadAt(trailer.index_offset, &_blocks[0],
+                trailer.num_blocks * sizeof(PINATRACE_INDEX_ENTRY)))
+    {
+        _blocks.clear();
+        return false;
+    }
+
+    PINATRACE_BLOCK_HEADER last;
+    if (!ReadAt(_blocks.back().offset, &last, sizeof(last)) ||
+        last.magic != PINATRACE_BLOCK_MAGIC)
+    {
+        _blocks.clear();
+        return false;
+    }
+    _numRecords = last.first_record + last.num_records;
+    return true;
+}
+
+void PINATRACE_READER::ScanBlocks(uint64_t fileSize)
+{
+    uint64_t offset = sizeof(_header);
+    PINATRACE_BLOCK_HEADER bh;
+
+    _blocks.clear();
+    _numRecords = 0;
+    while (offset + sizeof(bh) <= fileSize && ReadAt(offset, &bh, sizeof(bh)) &&
+           bh.magic == PINATRACE_BLOCK_MAGIC &&
+           offset + sizeof(bh) + bh.payload_size <= fileSize)
+    {
+        PINATRACE_INDEX_ENTRY e;
+        e.offset = offset;
+        e.first_record = bh.first_record;
+        _blocks.push_back(e);
+        _numRecords = bh.first_record + bh.num_records;
+        offset += sizeof(bh) + bh.payload_size;
+    }
+}
+
+bool PINATRACE_READER::ReadBlock(uint64_t block, std::vector<PINATRACE_RECORD64> & recs) const
+{
+    if (block >= _blocks.size())
+        return false;
+
+    if (_header.encoding == PINATRACE_ENCODING_RAW)
+    {
+        uint64_t first = _blocks[block].first_record;
+        uint64_t n = _numRecords - first;
+        if (n > PINATRACE_RAW_BLOCK_RECORDS)
+            n = PINATRACE_RAW_BLOCK_RECORDS;
+        recs.resize(n);
+        if (n == 0)
+            return true;
+
+        if (_header.addr_size == 8)
+            return ReadAt(_blocks[block].offset, &recs[0], n * sizeof(PINATRACE_RECORD64));
+
+        std::vector<PINATRACE_RECORD32> narrow(n);
+        if (!ReadAt(_blocks[block].offset, &narrow[0], n * sizeof(PINATRACE_RECORD32)))
+            return false;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            recs[i].ip = narrow[i].ip;
+            recs[i].ea = narrow[i].ea;
+            recs[i].size = narrow[i].size;
+            recs[i].flags = narrow[i].flags;
+        }
+        return true;
+    }
+
+    PINATRACE_BLOCK_HEADER bh;
+    if (!ReadAt(_blocks[block].offset, &bh, sizeof(bh)) || bh.magic != PINATRACE_BLOCK_MAGIC)
+        return false;
+
+    std::vector<uint8_t> payload(bh.payload_size);
+    recs.resize(bh.num_records);
+    if (bh.payload_size > 0 &&
+        !ReadAt(_blocks[block].offset + sizeof(bh), &payload[0], bh.payload_size))
+    {
+        return false;
+    }
+    if (bh.num_records == 0)
+        return bh.payload_size == 0;
+    return PINATRACE_DecodeBlock(bh.payload_size ? &payload[0] : NULL, bh.payload_size,
+                                 bh.num_records, &recs[0]);
+}
+
+const PINATRACE_RECORD64 * PINATRACE_READER::MappedBlock(uint64_t block,
+                                                         uint64_t * numRecords) const
+{
+    if (!_map || _header.encoding != PINATRACE_ENCODING_RAW || _header.addr_size != 8 ||
+        block >= _blocks.size())
+    {
+        return NULL;
+    }
+    uint64_t n = _numRecords - _blocks[block].first_record;
+    *numRecords = n < PINATRACE_RAW_BLOCK_RECORDS ? n : PINATRACE_RAW_BLOCK_RECORDS;
+    return (const PINATRACE_RECORD64 *)(_map + _blocks[block].offset);
+}
+
+bool PINATRACE_READER::Seek(uint64_t block)
+{
+    if (_fd < 0 || block > _blocks.size())
+        return false;
+    _nextBlock = block;
+    _current.clear();
+    _pos = 0;
+    return true;
+}
+
+bool PINATRACE_READER::Next(PINATRACE_RECORD64 & rec)
+{
+    while (_pos >= _current.size())
+    {
+        if (_fd < 0 || _nextBlock >= _blocks.size())
+            return false;
+        if (!ReadBlock(_nextBlock, _current))
+        {
+            char msg[64];
+            snprintf(msg, sizeof(msg), ": corrupt block %llu", (unsigned long long)_nextBlock);
+            _error = _path + msg;
+            _current.clear();
+            _nextBlock = _blocks.size();
+            return false;
+        }
+        _nextBlock++;
+        _pos = 0;
+    }
+    rec = _current[_pos++];
+    return true;
+}
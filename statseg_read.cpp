@@ -0,0 +1,212 @@
+/*
+ *  Native reader for the live statistics segment of a tool run with
+ *  -statseg NAME (see statseg_format.H):
+ *
+ *      statseg_read [-i ms] [-n count] [-threads] [-u] NAME
+ *
+ *  Prints the counters the tool maintains once, or every -i milliseconds
+ *  until the tool finishes or -n samples have been printed.  Every
+ *  sample is a line with the thread counters summed over all threads,
+ *  one per thread with -threads, and one with the global counters, each
+ *  starting with the milliseconds since the reader started.  -u removes
+ *  the segment afterwards.
+ *
+ *  The segment is mapped read only and copied under its seqlocks, so the
+ *  reader never holds up the instrumented process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "statseg_format.H"
+
+#define READ_TRIES 1000
+
+static void Usage(const char * prog)
+{
+    fprintf(stderr, "usage: %s [-i ms] [-n count] [-threads] [-u] <segment>\n", prog);
+}
+
+static uint64_t Millis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void PrintHeader(const STATSEG_HEADER & h)
+{
+    printf("# %s pid %u\n", h.tool, h.pid);
+    printf("# ms thread state");
+    for (uint32_t c = 0; c < STATSEG_THREAD_COUNTERS; c++)
+        if (h.thread_fields & (1U << c))
+            printf(" %s", STATSEG_ThreadNames[c]);
+    printf("\n");
+    if (h.global_fields)
+    {
+        printf("# ms global");
+        for (uint32_t c = 0; c < STATSEG_GLOBAL_COUNTERS; c++)
+            if (h.global_fields & (1U << c))
+                printf(" %s", STATSEG_GlobalNames[c]);
+        printf("\n");
+    }
+}
+
+static void PrintCounters(uint32_t fields, const uint64_t * counters, uint32_t n)
+{
+    for (uint32_t c = 0; c < n; c++)
+        if (fields & (1U << c))
+            printf(" %llu", (unsigned long long)counters[c]);
+    printf("\n");
+}
+
+// Prints one sample; returns false once the tool has finished
+static bool Sample(const STATSEG_HEADER * h, const STATSEG_THREAD * slots, bool threads,
+                   uint64_t ms)
+{
+    // Read the state first, so that the counters are at least as recent
+    bool done = h->state == STATSEG_DONE;
+    uint32_t n = h->num_threads;
+    if (n > h->max_threads)
+        n = h->max_threads;
+    __sync_synchronize();
+
+    uint64_t total[STATSEG_THREAD_COUNTERS];
+    memset(total, 0, sizeof(total));
+    uint32_t running = 0;
+    bool torn = false;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        STATSEG_THREAD t;
+        if (!STATSEG_Read(&slots[i].seq, &slots[i], &t, sizeof(t), READ_TRIES))
+            torn = true;
+        running += t.state == STATSEG_THREAD_RUNNING;
+        for (uint32_t c = 0; c < STATSEG_THREAD_COUNTERS; c++)
+            total[c] += t.counters[c];
+        if (threads)
+        {
+            printf("%llu %u %s", (unsigned long long)ms, t.tid,
+                   t.state == STATSEG_THREAD_RUNNING ? "running" : "exited");
+            PrintCounters(h->thread_fields, t.counters, STATSEG_THREAD_COUNTERS);
+        }
+    }
+    printf("%llu all %u/%u", (unsigned long long)ms, running, n);
+    PrintCounters(h->thread_fields, total, STATSEG_THREAD_COUNTERS);
+
+    if (h->global_fields)
+    {
+        uint64_t global[STATSEG_GLOBAL_COUNTERS];
+        if (!STATSEG_Read(&h->seq, h->global, global, sizeof(global), READ_TRIES))
+            torn = true;
+        printf("%llu global", (unsigned long long)ms);
+        PrintCounters(h->global_fields, global, STATSEG_GLOBAL_COUNTERS);
+    }
+    if (torn)
+        printf("# some counters were being updated and may be inconsistent\n");
+    if (h->lost_threads)
+        printf("# %u threads found no free slot\n", h->lost_threads);
+    fflush(stdout);
+    return !done;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long interval = 0;
+    unsigned long long count = 0;
+    bool threads = false;
+    bool unlinkAfter = false;
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        char * end = NULL;
+        if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
+            interval = strtoul(argv[++arg], &end, 0);
+        else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+            count = strtoull(argv[++arg], &end, 0);
+        else if (strcmp(argv[arg], "-threads") == 0)
+            threads = true;
+        else if (strcmp(argv[arg], "-u") == 0)
+            unlinkAfter = true;
+        else
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+        if (end && *end != '\0')
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - arg != 1)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    std::string name = argv[arg];
+    if (name[0] != '/')
+        name = STATSEG_DIR + name;
+    int fd = open(name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(name.c_str());
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(STATSEG_HEADER))
+    {
+        fprintf(stderr, "%s: not a statistics segment\n", name.c_str());
+        return 1;
+    }
+    void * mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror(name.c_str());
+        return 1;
+    }
+
+    const STATSEG_HEADER * h = (const STATSEG_HEADER *)mem;
+    if (strncmp(h->magic, STATSEG_MAGIC, sizeof(h->magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a statistics segment, or not ready yet\n", name.c_str());
+        return 1;
+    }
+    __sync_synchronize();
+    if (h->version != STATSEG_VERSION || h->header_size != sizeof(STATSEG_HEADER) ||
+        h->thread_size != sizeof(STATSEG_THREAD) ||
+        (uint64_t)st.st_size < h->header_size + (uint64_t)h->max_threads * h->thread_size)
+    {
+        fprintf(stderr, "%s: unsupported version %u\n", name.c_str(), h->version);
+        return 1;
+    }
+    const STATSEG_THREAD * slots = (const STATSEG_THREAD *)((const char *)mem + h->header_size);
+
+    PrintHeader(*h);
+    uint64_t start = Millis();
+    for (unsigned long long s = 1; ; s++)
+    {
+        bool running = Sample(h, slots, threads, Millis() - start);
+        if (!interval || !running || (count && s >= count))
+            break;
+        usleep(interval * 1000);
+    }
+
+    munmap(mem, st.st_size);
+    if (unlinkAfter && unlink(name.c_str()) != 0)
+    {
+        perror(name.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,595 @@
+/*
+ *  Native (non-Pin) parallel analyzer for the binary traces written by
+ *  pinatrace_mt.  Reads the per-thread trace files of one run and reports
+ *  what memfootprint_mt and dirty_pages would have, in their formats, so
+ *  that a program is traced once and analyzed as often as needed:
+ *
+ *      trace_analyze [-j threads] [-chunk blocks] [-sharing_csv file]
+ *                    [-o file] [-interval accesses] [-granularity bytes]...
+ *                    pinatrace_0.out pinatrace_1.out ...
+ *
+ *  The footprint goes to stdout and the sharing matrix to -sharing_csv,
+ *  as memfootprint_mt writes them; the dirty units per interval go to -o,
+ *  as dirty_pages writes them.  The traces hold no instruction counts, so
+ *  intervals are counted in memory accesses instead: interval k holds
+ *  accesses k*I to (k+1)*I-1 of every thread, for I of -interval, and the
+ *  first column of a row is the number of accesses in it.  Files of
+ *  region of interest windows are analyzed together, the windows of a
+ *  thread as one thread; give the files of one window to analyze it
+ *  alone.
+ *
+ *  The files are memory-mapped through the reader library and split into
+ *  chunks of -chunk blocks.  A pool of threads works through the chunks,
+ *  each thread taking its own from one end of its queue and, when it runs
+ *  out, stealing from the other end of the others' queues.  The per-chunk
+ *  address sets are then partitioned by address and reduced in parallel
+ *  the same way, as memfootprint_mt does at exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "pinatrace_reader.H"
+#include "addr_table.H"
+#include "dirty_set.H"
+#include "footprint.H"
+
+#define MERGE_PARTITIONS 256
+#define MERGE_PARTITION_SHIFT 56
+
+#define MERGE_READ  1
+#define MERGE_WRITE 2
+
+static void Usage(const char * prog)
+{
+    fprintf(stderr,
+            "usage: %s [-j threads] [-chunk blocks] [-sharing_csv file] [-o file]\n"
+            "       [-interval accesses] [-granularity bytes]... <binary trace>...\n", prog);
+}
+
+/* ===================================================================== */
+/* Work-stealing pool                                                    */
+/* ===================================================================== */
+
+struct TASK
+{
+    uint32_t file;              // chunks: the file and its blocks [first, last)
+    uint64_t first;             // partitions and intervals: the number in first
+    uint64_t last;
+};
+
+typedef void (*TASK_FUNC)(uint32_t worker, const TASK & task);
+
+// Every worker starts with a contiguous share of the tasks, works from the
+// back of its own queue and steals from the front of the others'.  No task
+// creates new ones, so a worker is done once every queue is empty.
+class WORK_POOL
+{
+  public:
+    WORK_POOL(uint32_t numWorkers) : _queues(numWorkers), _func(NULL)
+    {
+        for (uint32_t w = 0; w < numWorkers; w++)
+            pthread_mutex_init(&_queues[w].lock, NULL);
+    }
+
+    uint32_t NumWorkers() const { return _queues.size(); }
+
+    void Run(const std::vector<TASK> & tasks, TASK_FUNC func)
+    {
+        uint32_t n = _queues.size();
+        for (uint32_t w = 0; w < n; w++)
+        {
+            size_t first = tasks.size() * w / n;
+            size_t last = tasks.size() * (w + 1) / n;
+            _queues[w].tasks.assign(tasks.begin() + first, tasks.begin() + last);
+        }
+        _func = func;
+
+        std::vector<pthread_t> threads(n);
+        std::vector<WORKER_ARG> args(n);
+        for (uint32_t w = 1; w < n; w++)
+        {
+            args[w].pool = this;
+            args[w].worker = w;
+            pthread_create(&threads[w], NULL, Worker, &args[w]);
+        }
+        args[0].pool = this;
+        args[0].worker = 0;
+        Worker(&args[0]);
+        for (uint32_t w = 1; w < n; w++)
+            pthread_join(threads[w], NULL);
+    }
+
+  private:
+    struct QUEUE
+    {
+        pthread_mutex_t lock;
+        std::deque<TASK> tasks;
+    };
+
+    struct WORKER_ARG
+    {
+        WORK_POOL * pool;
+        uint32_t worker;
+    };
+
+    bool Take(uint32_t worker, TASK * task)
+    {
+        uint32_t n = _queues.size();
+        for (uint32_t k = 0; k < n; k++)
+        {
+            QUEUE & q = _queues[(worker + k) % n];
+            pthread_mutex_lock(&q.lock);
+            bool found = !q.tasks.empty();
+            if (found && k == 0)
+            {
+                *task = q.tasks.back();
+                q.tasks.pop_back();
+            }
+            else if (found)
+            {
+                *task = q.tasks.front();
+                q.tasks.pop_front();
+            }
+            pthread_mutex_unlock(&q.lock);
+            if (found)
+                return true;
+        }
+        return false;
+    }
+
+    static void * Worker(void * v)
+    {
+        WORKER_ARG * arg = static_cast<WORKER_ARG *>(v);
+        TASK task;
+        while (arg->pool->Take(arg->worker, &task))
+            arg->pool->_func(arg->worker, task);
+        return NULL;
+    }
+
+    std::vector<QUEUE> _queues;
+    TASK_FUNC _func;
+};
+
+/* ===================================================================== */
+/* Analyses                                                              */
+/* ===================================================================== */
+
+// A thread of the traced program, with the files of all its windows
+struct THREAD
+{
+    uint32_t tid;               // from the file name, as memfootprint_mt labels threads
+    uint32_t incarnation;
+    volatile uint64_t all_bytes_read;
+    volatile uint64_t addrs;    // distinct addresses
+};
+
+struct TRACE_FILE
+{
+    std::string path;
+    uint32_t thread;
+    PINATRACE_READER reader;
+};
+
+struct MERGE_ENTRY
+{
+    uint64_t addr;
+    uint32_t thread;
+    uint32_t access;            // MERGE_READ | MERGE_WRITE
+};
+
+static bool operator<(const MERGE_ENTRY & a, const MERGE_ENTRY & b)
+{
+    return a.addr < b.addr || (a.addr == b.addr && a.thread < b.thread);
+}
+
+struct MERGE_RESULT : FOOTPRINT_COUNTS
+{
+    std::vector<uint64_t> sharing;  // threads x threads addresses in common
+};
+
+// The dirty units of one interval, over all threads
+struct INTERVAL
+{
+    pthread_mutex_t lock;
+    DIRTY_SET * units;          // created on first use
+    uint64_t accesses;
+    std::vector<uint64_t> counts;   // by granularity
+};
+
+// What each worker accumulates
+struct WORKER_DATA
+{
+    std::vector<PINATRACE_RECORD64> records;    // blocks that cannot be used in place
+    std::vector<MERGE_ENTRY> buckets[MERGE_PARTITIONS];
+    MERGE_RESULT result;
+};
+
+static std::vector<TRACE_FILE *> files;
+static std::vector<THREAD *> threads;
+static std::vector<WORKER_DATA *> workers;
+static std::vector<INTERVAL *> intervals;
+static uint64_t intervalLength = 1000000;
+static std::vector<uint32_t> granularityShifts;
+static uint32_t unitShift = 0;
+static volatile int failed = 0;
+
+// Adds a chunk's dirty units to its interval
+static void FlushUnits(uint64_t interval, DIRTY_SET & units, uint64_t accesses)
+{
+    INTERVAL * in = intervals[interval];
+    pthread_mutex_lock(&in->lock);
+    if (!in->units)
+        in->units = new DIRTY_SET;
+    in->units->InsertAll(units);
+    in->accesses += accesses;
+    pthread_mutex_unlock(&in->lock);
+    units.Clear();
+}
+
+// Phase one: the addresses and dirty units of a run of blocks of one file
+static void ScanChunk(uint32_t worker, const TASK & task)
+{
+    WORKER_DATA * wd = workers[worker];
+    TRACE_FILE * tf = files[task.file];
+    ADDR_TABLE addrs;
+    DIRTY_SET units;
+    uint64_t bytes = 0;
+    uint64_t interval = ~0ULL;
+    uint64_t accesses = 0;
+
+    for (uint64_t b = task.first; b < task.last; b++)
+    {
+        uint64_t n;
+        const PINATRACE_RECORD64 * recs = tf->reader.MappedBlock(b, &n);
+        if (!recs)
+        {
+            if (!tf->reader.ReadBlock(b, wd->records))
+            {
+                fprintf(stderr, "%s: corrupt block %llu\n", tf->path.c_str(),
+                        (unsigned long long)b);
+                failed = 1;
+                continue;
+            }
+            recs = wd->records.empty() ? NULL : &wd->records[0];
+            n = wd->records.size();
+        }
+
+        uint64_t index = tf->reader.BlockFirstRecord(b);
+        for (uint64_t i = 0; i < n; i++, index++)
+        {
+            const PINATRACE_RECORD64 & rec = recs[i];
+            if (rec.flags & PINATRACE_FLAG_EOF)
+                continue;
+            bool write = (rec.flags & PINATRACE_FLAG_WRITE) != 0;
+
+            bytes += rec.size;
+            FOOTPRINT_Count(addrs, rec.ea, rec.size, !write, write);
+
+            if (index / intervalLength != interval)
+            {
+                if (interval != ~0ULL)
+                    FlushUnits(interval, units, accesses);
+                interval = index / intervalLength;
+                accesses = 0;
+            }
+            accesses++;
+            if (write)
+            {
+                uint64_t first = rec.ea >> unitShift;
+                uint64_t last = (rec.ea + (rec.size ? rec.size - 1 : 0)) >> unitShift;
+                for (uint64_t u = first; u <= last; u++)
+                    units.Insert(u >> 6, 1ULL << (u & 63));
+            }
+        }
+    }
+    if (interval != ~0ULL)
+        FlushUnits(interval, units, accesses);
+
+    __sync_fetch_and_add(&threads[tf->thread]->all_bytes_read, bytes);
+    for (uint64_t i = 0; i < addrs.Size(); i++)
+    {
+        const ADDRSTAT * stat = addrs.Record(i);
+        MERGE_ENTRY e;
+        e.addr = stat->addr;
+        e.thread = tf->thread;
+        e.access = (stat->is_read ? MERGE_READ : 0) | (stat->is_write ? MERGE_WRITE : 0);
+        wd->buckets[ADDR_TABLE::Hash(e.addr) >> MERGE_PARTITION_SHIFT].push_back(e);
+    }
+}
+
+// Phase two: classifies the addresses of one partition.  A thread may
+// have an address in several chunks and windows; its entries are
+// combined first.
+static void ReducePartition(uint32_t worker, const TASK & task)
+{
+    uint32_t part = task.first;
+    std::vector<MERGE_ENTRY> entries;
+    size_t total = 0;
+    for (uint32_t w = 0; w < workers.size(); w++)
+        total += workers[w]->buckets[part].size();
+    entries.reserve(total);
+    for (uint32_t w = 0; w < workers.size(); w++)
+    {
+        std::vector<MERGE_ENTRY> & bucket = workers[w]->buckets[part];
+        entries.insert(entries.end(), bucket.begin(), bucket.end());
+        std::vector<MERGE_ENTRY>().swap(bucket);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    MERGE_RESULT & r = workers[worker]->result;
+    uint32_t n = threads.size();
+    std::vector<uint32_t> sharers;
+    for (size_t first = 0; first < entries.size(); )
+    {
+        uint32_t access = 0;
+        size_t last = first;
+        sharers.clear();
+        for (; last < entries.size() && entries[last].addr == entries[first].addr; last++)
+        {
+            access |= entries[last].access;
+            if (sharers.empty() || sharers.back() != entries[last].thread)
+                sharers.push_back(entries[last].thread);
+        }
+
+        r.Add(sharers.size(), (access & MERGE_WRITE) != 0);
+
+        for (size_t i = 0; i < sharers.size(); i++)
+        {
+            __sync_fetch_and_add(&threads[sharers[i]]->addrs, 1);
+            for (size_t j = 0; j < sharers.size(); j++)
+                r.sharing[sharers[i] * n + sharers[j]]++;
+        }
+        first = last;
+    }
+}
+
+// Phase three: the dirty units of one interval at every granularity
+static void CountInterval(uint32_t, const TASK & task)
+{
+    INTERVAL * in = intervals[task.first];
+    in->counts.resize(granularityShifts.size(), 0);
+    for (uint32_t g = 0; in->units && g < granularityShifts.size(); g++)
+        in->counts[g] = in->units->CountUnits(granularityShifts[g] - unitShift);
+    delete in->units;
+    in->units = NULL;
+}
+
+static void WriteSharing(const char * name, const std::vector<uint64_t> & sharing)
+{
+    FILE * f = fopen(name, "w");
+    if (!f)
+    {
+        perror(name);
+        return;
+    }
+
+    uint32_t n = threads.size();
+    fprintf(f, "tid");
+    for (uint32_t j = 0; j < n; j++)
+        fprintf(f, ",%u", threads[j]->tid);
+    fprintf(f, "\n");
+    for (uint32_t i = 0; i < n; i++)
+    {
+        fprintf(f, "%u", threads[i]->tid);
+        for (uint32_t j = 0; j < n; j++)
+            fprintf(f, ",%llu", (unsigned long long)sharing[i * n + j]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+// The thread of a file: pinatrace_<tid>[_<incarnation>][_w<window>].out
+// belongs to the thread of its tid and incarnation, created on first
+// use; any other name is a thread of its own, numbered by its position
+static uint32_t ThreadOf(const std::string & path, uint32_t index,
+                         std::map<std::pair<uint32_t, uint32_t>, uint32_t> & known)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    unsigned tid, incarnation = 0;
+    int fields = sscanf(name.c_str(), "pinatrace_%u_%u", &tid, &incarnation);
+    if (fields >= 1)
+    {
+        std::pair<uint32_t, uint32_t> key(tid, incarnation);
+        std::map<std::pair<uint32_t, uint32_t>, uint32_t>::iterator it = known.find(key);
+        if (it != known.end())
+            return it->second;
+        known[key] = threads.size();
+    }
+    else
+        tid = index;
+
+    THREAD * t = new THREAD;
+    t->tid = tid;
+    t->incarnation = incarnation;
+    t->all_bytes_read = 0;
+    t->addrs = 0;
+    threads.push_back(t);
+    return threads.size() - 1;
+}
+
+int main(int argc, char *argv[])
+{
+    long numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t chunkBlocks = 16;
+    std::string sharingFile = "memfootprint_sharing.csv";
+    std::string dirtyFile = "dirty_pages.out";
+    std::vector<uint64_t> granularities;
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        bool more = arg + 1 < argc;
+        if (strcmp(argv[arg], "-j") == 0 && more)
+            numWorkers = strtol(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-chunk") == 0 && more)
+            chunkBlocks = strtoull(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-sharing_csv") == 0 && more)
+            sharingFile = argv[++arg];
+        else if (strcmp(argv[arg], "-o") == 0 && more)
+            dirtyFile = argv[++arg];
+        else if (strcmp(argv[arg], "-interval") == 0 && more)
+            intervalLength = strtoull(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-granularity") == 0 && more)
+            granularities.push_back(strtoull(argv[++arg], NULL, 0));
+        else
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (arg == argc || numWorkers < 1 || chunkBlocks < 1 || intervalLength < 1)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    if (granularities.empty())
+        granularities.push_back(4096);
+    for (size_t i = 0; i < granularities.size(); i++)
+    {
+        uint64_t g = granularities[i];
+        if (g == 0 || (g & (g - 1)) != 0)
+        {
+            fprintf(stderr, "Error: granularity %llu is not a power of two\n",
+                    (unsigned long long)g);
+            return 1;
+        }
+        granularityShifts.push_back(__builtin_ctzll(g));
+    }
+    std::sort(granularityShifts.begin(), granularityShifts.end());
+    granularityShifts.erase(std::unique(granularityShifts.begin(), granularityShifts.end()),
+                            granularityShifts.end());
+    unitShift = granularityShifts[0];
+
+    // Open everything and cut the files into chunks
+    std::vector<TASK> chunks;
+    uint64_t maxRecords = 0;
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> known;
+    for (; arg < argc; arg++)
+    {
+        TRACE_FILE * tf = new TRACE_FILE;
+        tf->path = argv[arg];
+        tf->thread = ThreadOf(tf->path, files.size(), known);
+        if (!tf->reader.Open(argv[arg]))
+        {
+            fprintf(stderr, "%s\n", tf->reader.Error().c_str());
+            return 1;
+        }
+        for (uint64_t b = 0; b < tf->reader.NumBlocks(); b += chunkBlocks)
+        {
+            TASK t;
+            t.file = files.size();
+            t.first = b;
+            t.last = std::min(b + chunkBlocks, tf->reader.NumBlocks());
+            chunks.push_back(t);
+        }
+        maxRecords = std::max(maxRecords, tf->reader.NumRecords());
+        files.push_back(tf);
+    }
+
+    uint64_t numIntervals = (maxRecords + intervalLength - 1) / intervalLength;
+    for (uint64_t i = 0; i < numIntervals; i++)
+    {
+        INTERVAL * in = new INTERVAL;
+        pthread_mutex_init(&in->lock, NULL);
+        in->units = NULL;
+        in->accesses = 0;
+        intervals.push_back(in);
+    }
+
+    WORK_POOL pool(numWorkers);
+    for (uint32_t w = 0; w < pool.NumWorkers(); w++)
+    {
+        workers.push_back(new WORKER_DATA);
+        workers[w]->result.sharing.assign(threads.size() * threads.size(), 0);
+    }
+
+    pool.Run(chunks, ScanChunk);
+
+    std::vector<TASK> parts;
+    for (uint32_t p = 0; p < MERGE_PARTITIONS; p++)
+    {
+        TASK t;
+        t.file = 0;
+        t.first = p;
+        t.last = p + 1;
+        parts.push_back(t);
+    }
+    pool.Run(parts, ReducePartition);
+
+    std::vector<TASK> counts;
+    for (uint64_t i = 0; i < numIntervals; i++)
+    {
+        TASK t;
+        t.file = 0;
+        t.first = i;
+        t.last = i + 1;
+        counts.push_back(t);
+    }
+    pool.Run(counts, CountInterval);
+
+    // Footprint, as memfootprint_mt prints it
+    MERGE_RESULT & total = workers[0]->result;
+    for (uint32_t w = 1; w < workers.size(); w++)
+    {
+        const MERGE_RESULT & r = workers[w]->result;
+        total.Add(r);
+        for (size_t i = 0; i < total.sharing.size(); i++)
+            total.sharing[i] += r.sharing[i];
+    }
+
+    printf("Number of threads ever exist = %u\n", (unsigned)threads.size());
+    uint64_t total_addrs = 0;
+    uint64_t total_all_bytes_read = 0;
+    for (uint32_t i = 0; i < threads.size(); i++)
+    {
+        printf("Thread %u addrs %llu all_bytes_read %llu\n", threads[i]->tid,
+               (unsigned long long)threads[i]->addrs,
+               (unsigned long long)threads[i]->all_bytes_read);
+        total_addrs += threads[i]->addrs;
+        total_all_bytes_read += threads[i]->all_bytes_read;
+    }
+    printf("Total addrs %llu\n", (unsigned long long)total_addrs);
+    total.Print(stdout);
+    printf("Total all_bytes_read %llu\n", (unsigned long long)total_all_bytes_read);
+
+    if (!sharingFile.empty())
+        WriteSharing(sharingFile.c_str(), total.sharing);
+
+    // Dirty units per interval, as dirty_pages writes them
+    FILE * out = fopen(dirtyFile.c_str(), "w");
+    if (!out)
+    {
+        perror(dirtyFile.c_str());
+        return 1;
+    }
+    if (granularityShifts.size() > 1)
+    {
+        fprintf(out, "# accesses");
+        for (uint32_t g = 0; g < granularityShifts.size(); g++)
+            fprintf(out, " %llu", 1ULL << granularityShifts[g]);
+        fprintf(out, "\n");
+    }
+    for (uint64_t i = 0; i < numIntervals; i++)
+    {
+        // The end-of-trace markers can leave the last interval empty
+        if (intervals[i]->accesses == 0)
+            continue;
+        fprintf(out, "%llu", (unsigned long long)intervals[i]->accesses);
+        for (uint32_t g = 0; g < granularityShifts.size(); g++)
+            fprintf(out, " %llu", (unsigned long long)intervals[i]->counts[g]);
+        fprintf(out, "\n");
+    }
+    fclose(out);
+
+    return failed;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Workload: every thread chases pointers around a random cycle through
+ *  its own nodes, one node per cache line.  The cycle comes from a
+ *  Sattolo shuffle of an index array.
+ *
+ *      wl_chase [-t threads=1] [-n nodes per thread=262144] [-r laps=4]
+ */
+
+#include "workload.H"
+
+struct NODE
+{
+    NODE * volatile next;
+    char pad[WL_LINE - sizeof(NODE *)];
+};
+
+static WL_ARGS args = { 1, 1 << 18, 4 };
+
+static void * Chase(void * arg)
+{
+    uint64_t n = args.size;
+    volatile uint32_t * order = (volatile uint32_t *)WL_Alloc(n * 4);
+    NODE * nodes = (NODE *)WL_Alloc(n * sizeof(NODE));
+
+    for (uint64_t i = 0; i < n; i++)
+        order[i] = i;
+    uint64_t state = 0x9e3779b97f4a7c15ULL + (uintptr_t)arg;
+    for (uint64_t i = n - 1; i > 0; i--)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t j = state % i;
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (uint64_t i = 0; i < n; i++)
+        nodes[order[i]].next = &nodes[order[(i + 1) % n]];
+
+    NODE * p = &nodes[0];
+    for (uint64_t s = 0; s < args.repeats * n; s++)
+        p = p->next;
+    wl_sink = (uintptr_t)p;
+    return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+    WL_ParseArgs(argc, argv, &args);
+    args.size = (args.size + WL_PAGE / 4 - 1) / (WL_PAGE / 4) * (WL_PAGE / 4);
+
+    WL_RunThreads(args.threads, Chase);
+
+    // Every index and every next pointer
+    WL_Expect("threads", args.threads + 1);
+    WL_Expect("unique_addrs", args.threads * args.size * 2);
+    WL_Expect("write_shared_addrs", 0);
+    WL_Expect("dirty_pages", args.threads * args.size * (4 + WL_LINE) / WL_PAGE);
+    WL_Expect("dirty_lines", args.threads * args.size * (4 + WL_LINE) / WL_LINE);
+    return 0;
+}
@@ -0,0 +1,251 @@
+#!/usr/bin/env python
+#
+#  Runs a workload natively and under a tool, checks the tool's results
+#  against the answers the workload prints (see workload.H) and appends
+#  the wall times to a CSV summary.  Used by the wl_*.test recipes in
+#  makefile.rules.
+#
+#      wl_check.py --pin PIN --tool TOOL --app WORKLOAD [--analyzer TRACE_ANALYZE]
+#                  [--sweep T1,T2,...] [--summary CSV] [--name TEST] [-- workload args]
+#
+#  The tool is recognized by its file name: memfootprint_mt, dirty_pages,
+#  pinatrace_mt or memanalyze_mt.  pinatrace_mt traces are checked through
+#  trace_analyze, which --analyzer names.  memanalyze_mt runs with all of
+#  its modules, so its checks also cover the cost of tracing.  With
+#  --sweep the workload runs once per thread count, with -t added to its
+#  arguments.
+#
+#  The tools see the loader, libc and thread creation as well as the
+#  workload, so a count passes if it is at least the expected value and at
+#  most SLACK above it.  The exit status is 1 if any check failed.
+#
+#  memfootprint_mt runs with -false_sharing when the workload expects a
+#  count of falsely shared lines.
+
+import csv
+import os
+import re
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import glob
+from optparse import OptionParser
+
+# metric: (relative slack, fixed slack, slack per thread)
+SLACK = {
+    'threads':              (0,    0,     0),
+    'unique_addrs':         (0.05, 65536, 2048),
+    'read_shared_addrs':    (0.05, 4096,  128),
+    'write_shared_addrs':   (0.05, 4096,  128),
+    'dirty_pages':          (0.05, 256,   8),
+    'dirty_lines':          (0.05, 8192,  128),
+    'false_shared_lines':   (0,    16,    2),
+}
+
+# The metrics each tool reports; pinatrace_mt through trace_analyze
+FOOTPRINT_METRICS = ['threads', 'unique_addrs', 'read_shared_addrs', 'write_shared_addrs']
+DIRTY_METRICS = ['threads', 'dirty_pages', 'dirty_lines']
+METRICS = {
+    'memfootprint_mt': FOOTPRINT_METRICS + ['false_shared_lines'],
+    'dirty_pages': DIRTY_METRICS,
+    'pinatrace_mt': FOOTPRINT_METRICS + DIRTY_METRICS[1:],
+    'memanalyze_mt': FOOTPRINT_METRICS + DIRTY_METRICS[1:],
+}
+
+HUGE_INTERVAL = 10 ** 15
+
+SUMMARY_FIELDS = ['test', 'workload', 'tool', 'args', 'native_s', 'tool_s', 'slowdown', 'result']
+
+
+def run(cmd, cwd):
+    """Runs cmd in cwd and returns its wall time and standard output."""
+    start = time.time()
+    proc = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.PIPE)
+    out = proc.communicate()[0]
+    seconds = time.time() - start
+    if not isinstance(out, str):
+        out = out.decode('utf-8', 'replace')
+    if proc.returncode != 0:
+        raise RuntimeError('%s exited with %d' % (' '.join(cmd), proc.returncode))
+    return seconds, out
+
+
+def parse_expect(text):
+    expect = {}
+    for line in text.splitlines():
+        words = line.split()
+        if len(words) == 3 and words[0] == 'expect':
+            expect[words[1]] = int(words[2])
+    return expect
+
+
+def parse_footprint(text):
+    """The totals printed by memfootprint_mt and trace_analyze."""
+    patterns = {
+        'threads': r'^Number of threads ever exist = (\d+)',
+        'unique_addrs': r'^Unique addrs (\d+)',
+        'read_shared_addrs': r'^Read-shared addrs (\d+)',
+        'write_shared_addrs': r'^Write-shared addrs (\d+)',
+        'false_shared_lines': r'^Falsely shared lines (\d+)',
+    }
+    found = {}
+    for metric, pattern in patterns.items():
+        m = re.search(pattern, text, re.M)
+        if m:
+            found[metric] = int(m.group(1))
+    return found
+
+
+def parse_dirty(path):
+    """The largest counts at 4096 and 64 bytes in a dirty_pages style file,
+    whose header names the granularity of each column."""
+    granularities = None
+    best = {}
+    for line in open(path):
+        words = line.split()
+        if not words:
+            continue
+        if words[0] == '#':
+            if len(words) > 2 and words[1] in ('instructions', 'accesses'):
+                granularities = [int(w) for w in words[2:]]
+            continue
+        for g, value in zip(granularities or [4096], words[1:]):
+            best[g] = max(best.get(g, 0), int(value))
+    found = {}
+    if 4096 in best:
+        found['dirty_pages'] = best[4096]
+    if 64 in best:
+        found['dirty_lines'] = best[64]
+    return found
+
+
+def measure(kind, opts, pin, app_cmd, workdir, expect):
+    """Runs the workload under the tool; returns the wall time and the
+    metrics found."""
+    tool = os.path.abspath(opts.tool)
+    if kind == 'memfootprint_mt':
+        knobs = ['-false_sharing', '1'] if 'false_shared_lines' in expect else []
+        seconds, out = run(pin + ['-t', tool] + knobs + ['--'] + app_cmd, workdir)
+        return seconds, parse_footprint(out)
+
+    if kind == 'dirty_pages':
+        seconds, out = run(pin + ['-t', tool, '-o', 'dirty.out', '-i', str(HUGE_INTERVAL),
+                                  '-granularity', '4096', '-granularity', '64', '--'] + app_cmd,
+                           workdir)
+        found = parse_footprint(out)
+        found.update(parse_dirty(os.path.join(workdir, 'dirty.out')))
+        return seconds, found
+
+    if kind == 'memanalyze_mt':
+        seconds, out = run(pin + ['-t', tool, '-trace', '1', '-trace_format', 'compressed',
+                                  '-footprint', '1', '-dirty', '1', '-dirty_o', 'dirty.out',
+                                  '-interval', str(HUGE_INTERVAL),
+                                  '-granularity', '4096', '-granularity', '64', '--'] + app_cmd,
+                           workdir)
+        found = parse_footprint(out)
+        found.update(parse_dirty(os.path.join(workdir, 'dirty.out')))
+        return seconds, found
+
+    seconds, out = run(pin + ['-t', tool, '-format', 'compressed', '--'] + app_cmd, workdir)
+    found = {'threads': parse_footprint(out).get('threads')}
+    traces = sorted(os.path.basename(f) for f in glob.glob(os.path.join(workdir, 'pinatrace_*.out')))
+    analyzer = [os.path.abspath(opts.analyzer), '-sharing_csv', '', '-o', 'dirty.out',
+                '-interval', str(HUGE_INTERVAL), '-granularity', '4096', '-granularity', '64']
+    dummy, out = run(analyzer + traces, workdir)
+    analyzed = parse_footprint(out)
+    analyzed.pop('threads', None)
+    found.update(analyzed)
+    found.update(parse_dirty(os.path.join(workdir, 'dirty.out')))
+    return seconds, found
+
+
+def check(expect, found, threads, metrics):
+    """Returns the failed checks of the metrics as messages."""
+    failures = []
+    for metric in sorted(expect):
+        if metric not in metrics:
+            continue
+        if found.get(metric) is None:
+            failures.append('%s: not reported' % metric)
+            continue
+        relative, fixed, per_thread = SLACK[metric]
+        low = expect[metric]
+        high = low + int(low * relative) + fixed + per_thread * threads
+        if not low <= found[metric] <= high:
+            failures.append('%s: %d, expected %d to %d' % (metric, found[metric], low, high))
+    return failures
+
+
+def main():
+    parser = OptionParser(usage='%prog --pin PIN --tool TOOL --app WORKLOAD [options] [-- args]')
+    parser.add_option('--pin', help='command that runs pin, split like a shell would')
+    parser.add_option('--tool', help='the tool to run')
+    parser.add_option('--app', help='the workload')
+    parser.add_option('--analyzer', help='trace_analyze, for pinatrace_mt')
+    parser.add_option('--sweep', help='thread counts, comma separated')
+    parser.add_option('--summary', default='wl_summary.csv', help='CSV file the timings go to')
+    parser.add_option('--name', help='test name in the summary')
+    opts, args = parser.parse_args()
+    if not opts.pin or not opts.tool or not opts.app:
+        parser.error('--pin, --tool and --app are required')
+
+    kind = os.path.basename(opts.tool).split('.')[0]
+    if kind not in METRICS:
+        parser.error('unknown tool %s' % opts.tool)
+    if kind == 'pinatrace_mt' and not opts.analyzer:
+        parser.error('pinatrace_mt needs --analyzer')
+
+    pin = shlex.split(opts.pin)
+    if os.path.exists(pin[0]):
+        pin[0] = os.path.abspath(pin[0])
+    app = os.path.abspath(opts.app)
+    workload = os.path.basename(opts.app).split('.')[0]
+    name = opts.name or '%s_%s' % (workload, kind)
+
+    runs = [args]
+    if opts.sweep:
+        runs = [args + ['-t', t] for t in opts.sweep.split(',')]
+
+    new_summary = not os.path.exists(opts.summary)
+    summary = open(opts.summary, 'a')
+    writer = csv.writer(summary)
+    if new_summary:
+        writer.writerow(SUMMARY_FIELDS)
+
+    failed = False
+    for app_args in runs:
+        workdir = tempfile.mkdtemp(prefix=name + '.', dir=os.path.dirname(os.path.abspath(opts.summary)))
+        try:
+            native, out = run([app] + app_args, workdir)
+            expect = parse_expect(out)
+            instrumented, found = measure(kind, opts, pin, [app] + app_args, workdir, expect)
+            failures = check(expect, found, expect.get('threads', 1), METRICS[kind])
+        except (RuntimeError, OSError) as e:
+            native, instrumented, failures = 0, 0, [str(e)]
+
+        label = ' '.join([name] + app_args)
+        for f in failures:
+            sys.stderr.write('%s: %s\n' % (label, f))
+        if failures:
+            failed = True
+            sys.stderr.write('%s: output kept in %s\n' % (label, workdir))
+        else:
+            shutil.rmtree(workdir)
+
+        writer.writerow([name, workload, kind, ' '.join(app_args), '%.3f' % native,
+                         '%.3f' % instrumented,
+                         '%.1f' % (instrumented / native) if native > 0 else '',
+                         'fail' if failures else 'pass'])
+        summary.flush()
+        print('%s: %s, native %.3f s, %s %.3f s' %
+              (label, 'FAIL' if failures else 'pass', native, kind, instrumented))
+
+    summary.close()
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
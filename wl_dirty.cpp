@@ -0,0 +1,46 @@
+/*
+ *  Workload: dirties pages.  The threads split a buffer of pages between
+ *  them and in every pass write one byte in each of the first lines of
+ *  every page of their share.
+ *
+ *      wl_dirty [-t threads=2] [-n pages=8192] [-r passes=8]
+ *
+ *  LINES_PER_PAGE lines are written per page, so the dirty pages and
+ *  lines are known exactly and differ from the unique addresses.
+ */
+
+#include "workload.H"
+
+#define LINES_PER_PAGE 4
+
+static WL_ARGS args = { 2, 8192, 8 };
+
+static void * Dirty(void *)
+{
+    uint64_t pages = args.size / args.threads;
+    volatile uint8_t * buf = (volatile uint8_t *)WL_Alloc(pages * WL_PAGE);
+    for (uint64_t r = 0; r < args.repeats; r++)
+    {
+        for (uint64_t p = 0; p < pages; p++)
+        {
+            for (uint64_t l = 0; l < LINES_PER_PAGE; l++)
+                buf[p * WL_PAGE + l * WL_LINE] = r;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+    WL_ParseArgs(argc, argv, &args);
+    args.size = (args.size + args.threads - 1) / args.threads * args.threads;
+
+    WL_RunThreads(args.threads, Dirty);
+
+    WL_Expect("threads", args.threads + 1);
+    WL_Expect("unique_addrs", args.size * LINES_PER_PAGE);
+    WL_Expect("write_shared_addrs", 0);
+    WL_Expect("dirty_pages", args.size);
+    WL_Expect("dirty_lines", args.size * LINES_PER_PAGE);
+    return 0;
+}
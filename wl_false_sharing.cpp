@@ -0,0 +1,85 @@
+/*
+ *  Workload: a producer and a consumer pass words through a ring.  The
+ *  head and tail indices share a cache line, and so do the two threads'
+ *  private item counters, which are never touched by the other thread:
+ *  the line is falsely shared while the addresses are not.  So is the
+ *  line of the indices, which each thread writes one of.
+ *
+ *      wl_false_sharing [-n items=262144] [-r ring slots=64]
+ *
+ *  -t is ignored, there are always two threads.
+ */
+
+#include <sched.h>
+#include "workload.H"
+
+// One page: the indices, the counters and the ring in lines of their own
+struct QUEUE
+{
+    volatile uint64_t head;                 // written by the producer
+    volatile uint64_t tail;                 // written by the consumer
+    char pad0[WL_LINE - 16];
+    volatile uint64_t counts[2];            // one per thread
+    char pad1[WL_LINE - 16];
+    volatile uint64_t ring[(WL_PAGE - 2 * WL_LINE) / 8];
+} __attribute__((aligned(WL_PAGE)));
+
+static QUEUE queue;
+static WL_ARGS args = { 2, 1 << 18, 64 };
+
+// Thread 0 produces and thread 1 consumes.  They yield while they wait,
+// so that they also make progress on a single processor.
+static void * Run(void * arg)
+{
+    uint64_t slots = args.repeats;
+    uint64_t items = args.size;
+    if (arg == 0)
+    {
+        for (uint64_t i = 0; i < items; i++)
+        {
+            while (queue.head - queue.tail == slots)
+                sched_yield();
+            queue.ring[queue.head % slots] = i;
+            queue.head = queue.head + 1;
+            queue.counts[0] = queue.counts[0] + 1;
+        }
+    }
+    else
+    {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < items; i++)
+        {
+            while (queue.tail == queue.head)
+                sched_yield();
+            sum += queue.ring[queue.tail % slots];
+            queue.tail = queue.tail + 1;
+            queue.counts[1] = queue.counts[1] + 1;
+        }
+        wl_sink = sum;
+    }
+    return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+    WL_ParseArgs(argc, argv, &args);
+    uint64_t maxSlots = sizeof(queue.ring) / 8;
+    if (args.repeats == 0 || args.repeats > maxSlots)
+        args.repeats = maxSlots;
+    if (args.size < args.repeats)
+        args.size = args.repeats;
+
+    WL_RunThreads(2, Run);
+
+    // The ring slots and both indices are shared, the counters are not.
+    // The line of the indices and that of the counters are written by
+    // both threads on disjoint bytes.
+    uint64_t slots = args.repeats;
+    WL_Expect("threads", 3);
+    WL_Expect("unique_addrs", slots + 4);
+    WL_Expect("write_shared_addrs", slots + 2);
+    WL_Expect("false_shared_lines", 2);
+    WL_Expect("dirty_pages", 1);
+    WL_Expect("dirty_lines", 2 + (slots * 8 + WL_LINE - 1) / WL_LINE);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Workload: every thread streams over its own array of 64-bit words,
+ *  reading and writing each word in every pass.
+ *
+ *      wl_stream [-t threads=4] [-n words per thread=1048576] [-r passes=4]
+ */
+
+#include "workload.H"
+
+static WL_ARGS args = { 4, 1 << 20, 4 };
+
+static void * Stream(void *)
+{
+    volatile uint64_t * a = (volatile uint64_t *)WL_Alloc(args.size * 8);
+    for (uint64_t i = 0; i < args.size; i++)
+        a[i] = i;
+
+    uint64_t sum = 0;
+    for (uint64_t r = 0; r < args.repeats; r++)
+    {
+        for (uint64_t i = 0; i < args.size; i++)
+        {
+            sum += a[i];
+            a[i] = sum;
+        }
+    }
+    wl_sink = sum;
+    return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+    WL_ParseArgs(argc, argv, &args);
+    args.size = (args.size + WL_PAGE / 8 - 1) / (WL_PAGE / 8) * (WL_PAGE / 8);
+
+    WL_RunThreads(args.threads, Stream);
+
+    WL_Expect("threads", args.threads + 1);
+    WL_Expect("unique_addrs", args.threads * args.size);
+    WL_Expect("write_shared_addrs", 0);
+    WL_Expect("dirty_pages", args.threads * args.size * 8 / WL_PAGE);
+    WL_Expect("dirty_lines", args.threads * args.size * 8 / WL_LINE);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ *  Workload for thread count sweeps: the main thread fills a table, then
+ *  every thread reads all of it and writes a page of words of its own.
+ *
+ *      wl_threads [-t threads=16] [-n table words=4096] [-r passes=4]
+ */
+
+#include "workload.H"
+
+#define WORDS_PER_THREAD (WL_PAGE / 8)
+
+static WL_ARGS args = { 16, 4096, 4 };
+static volatile uint64_t * table;
+
+static void * Work(void * arg)
+{
+    volatile uint64_t * mine = (volatile uint64_t *)WL_Alloc(WL_PAGE);
+    uint64_t sum = (uintptr_t)arg;
+    for (uint64_t r = 0; r < args.repeats; r++)
+    {
+        for (uint64_t i = 0; i < args.size; i++)
+        {
+            sum += table[i];
+            mine[i % WORDS_PER_THREAD] = sum;
+        }
+    }
+    wl_sink = sum;
+    return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+    WL_ParseArgs(argc, argv, &args);
+    args.size = (args.size + WORDS_PER_THREAD - 1) / WORDS_PER_THREAD * WORDS_PER_THREAD;
+    if (args.size == 0)
+        args.size = WORDS_PER_THREAD;
+
+    table = (volatile uint64_t *)WL_Alloc(args.size * 8);
+    for (uint64_t i = 0; i < args.size; i++)
+        table[i] = i;
+
+    WL_RunThreads(args.threads, Work);
+
+    // The table is written by the main thread and read by the others
+    WL_Expect("threads", args.threads + 1);
+    WL_Expect("unique_addrs", args.size + args.threads * WORDS_PER_THREAD);
+    WL_Expect("write_shared_addrs", args.size);
+    WL_Expect("dirty_pages", args.size * 8 / WL_PAGE + args.threads);
+    WL_Expect("dirty_lines", (args.size + args.threads * WORDS_PER_THREAD) * 8 / WL_LINE);
+    return 0;
+}